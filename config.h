@@ -44,7 +44,8 @@
   "syn-array.rep", \
   "syn-mix.rep", \
   "syn-string.rep", \
-  "syn-struct.rep"
+  "syn-struct.rep", \
+  "syn-align.rep"
 
 /*
  * Programs for measuring reference throughputs
@@ -40,8 +40,8 @@
 #define REF_ONLY 0
 #endif
 
-/* Returns true if p is ALIGNMENT-byte aligned */
-#define IS_ALIGNED(p)  ((((unsigned long)(p)) % ALIGNMENT) == 0)
+/* Returns true if p is a-byte aligned */
+#define IS_ALIGNED(p, a)  ((((unsigned long)(p)) % (a)) == 0)
 
 /* weights */
 typedef enum { WNONE, WALL, WUTIL, WPERF } weight_t;
@@ -80,9 +80,10 @@ typedef struct {
 
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
-    enum { ALLOC, FREE, REALLOC } type; /* type of request */
+    enum { ALLOC, FREE, REALLOC, MEMALIGN } type; /* type of request */
     long index;                         /* index for free() to use later */
     size_t size;                        /* byte size of alloc/realloc request */
+    size_t align;                       /* payload alignment it requires */
 } traceop_t;
 
 /* Holds the information for one trace file */
@@ -106,6 +107,7 @@ typedef struct {
 typedef struct {
     trace_t *trace;
     range_set_t *ranges;
+    bool sized;            /* free with mm_free_sized where it may be */
 } speed_t;
 
 /* Summarizes the important stats for some malloc function on some trace */
@@ -121,6 +123,12 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;       /* space utilization for this trace (always 0 for libc) */
+    double sbrks;      /* mem_sbrk calls in the utilization run (always 0 for libc) */
+    double peak_kb;    /* largest heap size in KiB in that run (always 0 for libc) */
+    double final_kb;   /* heap size in KiB at the end of that run (always 0 for libc) */
+    double quick_hit;  /* share of eligible mallocs served from a quick list, or -1 */
+    double sized_secs; /* secs for the trace with sized frees, with -S */
+    struct mm_stats alloc; /* mm_stats at the end of the utilization run */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
@@ -143,6 +151,63 @@ typedef struct {
  *******************/
 #define RANDOM_DATA_LEN (1<<16)
 
+/*
+ * The -B microbenchmark allocates BATCH_N objects of one size and then
+ * frees them in shuffled order, BATCH_ROUNDS times, either one call at
+ * a time or with mm_malloc_batch and mm_free_batch.
+ */
+#define BATCH_N      1000
+#define BATCH_ROUNDS 16
+
+typedef struct {
+    size_t size;          /* bytes per object */
+    bool batch;           /* use the batch calls */
+    void **ptrs;          /* the BATCH_N objects */
+    void **order;         /* the same, in the order they are freed */
+    const int *perm;      /* that order, a permutation of 0..BATCH_N-1 */
+} batch_bench_t;
+
+/*
+ * The -H microbenchmark serves BATCH_ROUNDS requests of BATCH_N objects
+ * of one size each.  Every request frees its objects at the end, with
+ * mm_free, by destroying the mm_heap it made them in, by releasing a
+ * long-lived mm_heap to the mark taken at its start, or by giving each
+ * back to a long-lived mm_heap with mm_heap_free.
+ */
+typedef enum { HEAP_FREE, HEAP_DESTROY, HEAP_RELEASE, HEAP_REUSE } heap_how_t;
+
+typedef struct {
+    size_t size;          /* bytes per object */
+    heap_how_t how;       /* how each request frees its objects */
+    void **ptrs;          /* the BATCH_N objects */
+} heap_bench_t;
+
+/*
+ * The -Z microbenchmark grows a fresh heap by CALLOC_BYTES in objects of
+ * one size, cleared either by mm_calloc or by mm_malloc and memset, and
+ * writes one byte of each.
+ */
+#define CALLOC_BYTES (16 << 20)
+
+typedef struct {
+    size_t size;          /* bytes per object */
+    bool calloc;          /* use mm_calloc */
+} calloc_bench_t;
+
+/*
+ * The -F, -P and -X reruns each run the traces once per column of a
+ * matrix, at most MATRIX_MAX columns, calling a setter for the column
+ * before its run.
+ *
+ * The -X rerun sets each of split_thresholds in turn, SIZE_MAX placing
+ * every fit at the front of its free block and one of them mm.c's own
+ * threshold, which is restored afterwards.
+ */
+#define MATRIX_MAX  8
+#define SPLIT_STEPS 4
+
+static size_t split_thresholds[SPLIT_STEPS];
+
 typedef unsigned char randint_t;
 static const char randint_t_name[] = "byte";
 static randint_t random_data[RANDOM_DATA_LEN];
@@ -160,6 +225,14 @@ int verbose = REF_ONLY ? 0 : 1;  /* global flag for verbose output */
 static int errors = 0;           /* number of errs found when running student malloc */
 static bool onetime_flag = false;
 static bool tab_mode = false;     /* Print output as tab-separated fields */
+static bool sized_free = false;   /* Time each trace again with sized frees */
+static bool batch_bench = false;  /* Run the batch microbenchmark */
+static bool calloc_bench = false; /* Run the calloc microbenchmark */
+static bool heap_bench = false;   /* Run the mm_heap microbenchmark */
+static bool alloc_stats = false;  /* Print mm_stats for each trace */
+static bool order_bench = false;  /* Rerun the traces with address-ordered lists */
+static bool policy_bench = false; /* Rerun the traces under every fit policy */
+static bool split_bench = false;  /* Rerun the traces at each split threshold */
 static size_t maxfill = MAXFILL;
 
 /* by default, no timeouts */
@@ -222,6 +295,17 @@ static void eval_mm_speed(void *ptr);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats, sum_stats_t *sumstats);
+static void printsized(int n, stats_t *stats);
+static void printallocstats(int n, stats_t *stats);
+static void runmatrix(const char *title, int cols, const char **labels,
+                      void (*set)(int col), int n, const char *tracedir,
+                      char **tracefiles, speed_t *speed_params);
+static void set_order(int col);
+static void set_policy(int col);
+static void set_split(int col);
+static void run_batch_bench(void);
+static void run_calloc_bench(void);
+static void run_heap_bench(void);
 static void usage(char *prog);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
     __attribute__((format(printf, 3,4)));
@@ -242,6 +326,12 @@ static void timeout_handler(int sig __attribute__((unused))) {
 /* Compute throughput from reference implementation */
 static double measure_ref_throughput();
 
+/* The mm_stats arrays below hide the function of that name */
+static void get_alloc_stats(struct mm_stats *stats)
+{
+    mm_stats(stats);
+}
+
 /*
  * Run the tests; return the number of tests run (may be less than
  * num_tracefiles, if there's a timeout)
@@ -284,11 +374,25 @@ static void run_tests(int num_tracefiles, const char *tracedir,
             if (verbose > 1)
                 printf("efficiency, ");
             mm_stats[i].util = eval_mm_util(trace, i);
+            mm_stats[i].sbrks = mem_sbrk_calls();
+            mm_stats[i].peak_kb = mem_heap_peak() / 1024.0;
+            mm_stats[i].final_kb = (mem_heapsize() + mem_mapsize()) / 1024.0;
+            {
+                size_t hits, lookups;
+                mm_quick_stats(&hits, &lookups);
+                mm_stats[i].quick_hit = lookups ? (double) hits / lookups : -1;
+            }
+            get_alloc_stats(&mm_stats[i].alloc);
             speed_params->trace = trace;
             speed_params->ranges = ranges;
+            speed_params->sized = false;
             if (verbose > 1)
                 printf("and performance.\n");
             mm_stats[i].secs = fsec(eval_mm_speed, speed_params);
+            if (sized_free) {
+                speed_params->sized = true;
+                mm_stats[i].sized_secs = fsec(eval_mm_speed, speed_params);
+            }
         }
 
 #if 0
@@ -356,7 +460,7 @@ int main(int argc, char **argv)
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hOVlDT")) != EOF) {
+    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hHOPVlABDFSTXZ")) != EOF) {
         switch (c) {
 
             case 'f': /* Use one specific trace file only (relative to curr dir) */
@@ -406,6 +510,38 @@ int main(int argc, char **argv)
                 tab_mode = true;
                 break;
 
+            case 'S': /* Also time sized frees */
+                sized_free = true;
+                break;
+
+            case 'A': /* Print allocator statistics */
+                alloc_stats = true;
+                break;
+
+            case 'F': /* LIFO against address-ordered free lists */
+                order_bench = true;
+                break;
+
+            case 'P': /* Every fit policy on every trace */
+                policy_bench = true;
+                break;
+
+            case 'X': /* Every split threshold on every trace */
+                split_bench = true;
+                break;
+
+            case 'B': /* Batch calls against single ones */
+                batch_bench = true;
+                break;
+
+            case 'H': /* mm_heap requests against malloc and free */
+                heap_bench = true;
+                break;
+
+            case 'Z': /* calloc against malloc and memset */
+                calloc_bench = true;
+                break;
+
             case 'h': /* Print this message */
                 usage(argv[0]);
                 exit(0);
@@ -514,6 +650,76 @@ int main(int argc, char **argv)
             printf("\nResults for mm malloc:\n");
             printresults(num_global_tracefiles, mm_stats, &global_mm_sum_stats);
             printf("\n");
+            if (alloc_stats) {
+                printf("Allocator statistics after each utilization run:\n");
+                printallocstats(num_global_tracefiles, mm_stats);
+                printf("\n");
+            }
+            if (order_bench) {
+                const char *labels[2] = {"lifo", "addr"};
+
+                runmatrix("LIFO against address-ordered free lists", 2, labels,
+                          set_order, num_global_tracefiles, tracedir,
+                          global_tracefiles, &speed_params);
+                mm_set_free_order(MM_ORDER_LIFO);
+                printf("\n");
+            }
+            if (policy_bench) {
+                const char *labels[MM_POLICIES];
+
+                for (int p = 0; p < MM_POLICIES; p++)
+                    labels[p] = mm_policy_name((enum mm_policy)p);
+                runmatrix("Utilization and Kops under each fit policy",
+                          MM_POLICIES, labels, set_policy, num_global_tracefiles,
+                          tracedir, global_tracefiles, &speed_params);
+                mm_clear_policy();
+                printf("\n");
+            }
+            if (split_bench) {
+                size_t split_default = mm_split_threshold();
+                char names[SPLIT_STEPS][32];
+                const char *labels[SPLIT_STEPS];
+
+                split_thresholds[0] = SIZE_MAX;
+                split_thresholds[1] = 1024;
+                split_thresholds[2] = split_default;
+                split_thresholds[3] = 16384;
+                for (int t = 0; t < SPLIT_STEPS; t++) {
+                    if (split_thresholds[t] == SIZE_MAX)
+                        snprintf(names[t], sizeof(names[t]), "front");
+                    else
+                        snprintf(names[t], sizeof(names[t]), "%zu", split_thresholds[t]);
+                    labels[t] = names[t];
+                }
+                runmatrix("Utilization and Kops at each split threshold",
+                          SPLIT_STEPS, labels, set_split, num_global_tracefiles,
+                          tracedir, global_tracefiles, &speed_params);
+                mm_set_split_threshold(split_default);
+                printf("\n");
+            }
+            if (sized_free) {
+                printf("Sized free against plain free:\n");
+                printsized(num_global_tracefiles, mm_stats);
+                printf("\n");
+            }
+            if (batch_bench) {
+                printf("Batch calls against single ones, %d objects x %d rounds:\n",
+                       BATCH_N, BATCH_ROUNDS);
+                run_batch_bench();
+                printf("\n");
+            }
+            if (heap_bench) {
+                printf("Requests of %d objects, freed one at a time or by mm_heap:\n",
+                       BATCH_N);
+                run_heap_bench();
+                printf("\n");
+            }
+            if (calloc_bench) {
+                printf("mm_calloc against mm_malloc and memset, %d MB fresh heap:\n",
+                       CALLOC_BYTES >> 20);
+                run_calloc_bench();
+                printf("\n");
+            }
         }
     }
 
@@ -682,25 +888,35 @@ static range_set_t *new_range_set() {
 static bool add_range(range_set_t *ranges, char *lo, size_t size,
                       const trace_t *trace, int opnum, int index) {
     char *hi = lo + size - 1;
+    size_t align = trace->ops[opnum].align;
 
     assert(size > 0);
 
-    /* Payload addresses must be ALIGNMENT-byte aligned */
-    if (!IS_ALIGNED(lo)) {
+    /* Payload addresses must be aligned as the request asked */
+    if (!IS_ALIGNED(lo, align)) {
         malloc_error(trace, opnum,
-                     "Payload address (%p) not aligned to %d bytes", lo, ALIGNMENT);
+                     "Payload address (%p) not aligned to %zu bytes", lo, align);
         return false;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap or a mapped region */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
+         (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+        !mem_in_map(lo, hi)) {
         malloc_error(trace, opnum,
                      "Payload (%p:%p) lies outside heap (%p:%p)",
                      lo, hi, mem_heap_lo(), mem_heap_hi());
         return false;
     }
 
+    /* The allocator may give more room than asked for, never less */
+    if (mm_malloc_usable_size(lo) < size) {
+        malloc_error(trace, opnum,
+                     "Usable size %zu of payload %p is less than the %zu bytes asked for",
+                     mm_malloc_usable_size(lo), lo, size);
+        return false;
+    }
+
     /* If we can't afford the linear-time loop, we check less thoroughly and
        just assume the overlap will be caught by writing random bits. */
     if (debug_mode == DBG_NONE) return 1;
@@ -903,7 +1119,7 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     trace_t *trace;
     char type[MAXLINE];
     int index;
-    size_t size;
+    size_t size, align;
     int max_index = 0;
     int op_index;
     int ignore = 0;
@@ -963,6 +1179,18 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
                 trace->ops[op_index].type = ALLOC;
                 trace->ops[op_index].index = index;
                 trace->ops[op_index].size = size;
+                trace->ops[op_index].align = ALIGNMENT;
+                max_index = (index > max_index) ? index : max_index;
+                break;
+            case 'm':
+                ignore += fscanf(tracefile, "%u %lu %lu", &index, &align, &size);
+                if (align == 0 || (align & (align - 1)) != 0)
+                    app_error("%s: memalign alignment %zu is not a power of 2",
+                              trace->filename, align);
+                trace->ops[op_index].type = MEMALIGN;
+                trace->ops[op_index].index = index;
+                trace->ops[op_index].size = size;
+                trace->ops[op_index].align = align;
                 max_index = (index > max_index) ? index : max_index;
                 break;
             case 'r':
@@ -970,6 +1198,7 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
                 trace->ops[op_index].type = REALLOC;
                 trace->ops[op_index].index = index;
                 trace->ops[op_index].size = size;
+                trace->ops[op_index].align = ALIGNMENT;
                 max_index = (index > max_index) ? index : max_index;
                 break;
             case 'f':
@@ -1072,9 +1301,14 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
         switch (trace->ops[i].type) {
 
             case ALLOC: /* mm_malloc */
+            case MEMALIGN: /* mm_memalign */
 
                 /* Call the student's malloc */
-                if ((p = mm_malloc(size)) == NULL) {
+                if (trace->ops[i].type == ALLOC)
+                    p = mm_malloc(size);
+                else
+                    p = mm_memalign(trace->ops[i].align, size);
+                if (p == NULL) {
                     malloc_error(trace, i, "mm_malloc failed.");
                     return false;
                 }
@@ -1166,9 +1400,9 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
  *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   package on the trace, plus whatever it has mapped with mem_map.
+ *   The heap can shrink, so heapsize is the largest size seen after
+ *   any request.
  *
  *   A higher number is better: 1 is optimal.
  */
@@ -1195,10 +1429,15 @@ static double eval_mm_util(trace_t *trace, int tracenum)
         switch (trace->ops[i].type) {
 
             case ALLOC: /* mm_alloc */
+            case MEMALIGN: /* mm_memalign */
                 index = trace->ops[i].index;
                 size = trace->ops[i].size;
 
-                if ((p = mm_malloc(size)) == NULL) {
+                if (trace->ops[i].type == ALLOC)
+                    p = mm_malloc(size);
+                else
+                    p = mm_memalign(trace->ops[i].align, size);
+                if (p == NULL) {
                     app_error("trace %d: mm_malloc failed in eval_mm_util",
                               tracenum);
                 }
@@ -1251,7 +1490,7 @@ static double eval_mm_util(trace_t *trace, int tracenum)
         /* update the high-water mark */
         max_total_size = (total_size > max_total_size) ?
             total_size : max_total_size;
-        heap_size = mem_heapsize();
+        heap_size = mem_heapsize() + mem_mapsize();
         max_heap_size = (heap_size > max_heap_size) ?
             heap_size : max_heap_size;
     }
@@ -1274,6 +1513,7 @@ static void eval_mm_speed(void *ptr)
     size_t size, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
+    bool sized = ((speed_t *)ptr)->sized;
     reinit_trace(trace);
 
     /* Reset the heap and initialize the mm package */
@@ -1291,6 +1531,19 @@ static void eval_mm_speed(void *ptr)
                 if ((p = mm_malloc(size)) == NULL)
                     app_error("mm_malloc error in eval_mm_speed");
                 trace->blocks[index] = p;
+                if (sized)
+                    trace->block_sizes[index] = size;
+                break;
+
+            case MEMALIGN: /* mm_memalign */
+                index = trace->ops[i].index;
+                size = trace->ops[i].size;
+                if ((p = mm_memalign(trace->ops[i].align, size)) == NULL)
+                    app_error("mm_memalign error in eval_mm_speed");
+                trace->blocks[index] = p;
+                /* Sized frees are only for malloc and realloc */
+                if (sized)
+                    trace->block_sizes[index] = 0;
                 break;
 
             case REALLOC: /* mm_realloc */
@@ -1300,6 +1553,8 @@ static void eval_mm_speed(void *ptr)
                 if ((newp = mm_realloc(oldp,newsize)) == NULL && newsize != 0)
                     app_error("mm_realloc error in eval_mm_speed");
                 trace->blocks[index] = newp;
+                if (sized)
+                    trace->block_sizes[index] = newsize;
                 break;
 
             case FREE: /* mm_free */
@@ -1309,7 +1564,10 @@ static void eval_mm_speed(void *ptr)
                 } else {
                     block = trace->blocks[index];
                 }
-                mm_free(block);
+                if (sized && index >= 0 && trace->block_sizes[index])
+                    mm_free_sized(block, trace->block_sizes[index]);
+                else
+                    mm_free(block);
                 break;
 
             default:
@@ -1317,6 +1575,248 @@ static void eval_mm_speed(void *ptr)
         }
 }
 
+/*
+ * eval_mm_batch - This is the function that is used by fcyc() to time
+ *    one size of the batch microbenchmark.
+ */
+static void eval_mm_batch(void *ptr)
+{
+    batch_bench_t *b = ptr;
+    int i, round;
+
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("mm_init failed in eval_mm_batch");
+
+    for (round = 0; round < BATCH_ROUNDS; round++) {
+        if (b->batch) {
+            if (mm_malloc_batch(b->size, BATCH_N, b->ptrs) != BATCH_N)
+                app_error("mm_malloc_batch error in eval_mm_batch");
+        } else {
+            for (i = 0; i < BATCH_N; i++)
+                if ((b->ptrs[i] = mm_malloc(b->size)) == NULL)
+                    app_error("mm_malloc error in eval_mm_batch");
+        }
+
+        for (i = 0; i < BATCH_N; i++)
+            b->order[i] = b->ptrs[b->perm[i]];
+        if (b->batch) {
+            mm_free_batch(b->order, BATCH_N);
+        } else {
+            for (i = 0; i < BATCH_N; i++)
+                mm_free(b->order[i]);
+        }
+    }
+}
+
+/*
+ * run_batch_bench - times the batch microbenchmark for a range of
+ *    object sizes and prints the results
+ */
+static void run_batch_bench(void)
+{
+    static const size_t sizes[] = { 16, 64, 256, 512, 1024, 4096, 65536 };
+    static void *ptrs[BATCH_N], *order[BATCH_N];
+    static int perm[BATCH_N];
+    batch_bench_t b = { 0, false, ptrs, order, perm };
+    double ops = 2.0 * BATCH_N * BATCH_ROUNDS;
+    unsigned int seed = 1;
+    int i, j, t;
+
+    /* Shuffle the free order, the same for every size and both ways */
+    for (i = 0; i < BATCH_N; i++)
+        perm[i] = i;
+    for (i = BATCH_N - 1; i > 0; i--) {
+        seed = seed * 1103515245 + 12345;
+        j = (seed >> 16) % (i + 1);
+        t = perm[i]; perm[i] = perm[j]; perm[j] = t;
+    }
+
+    mem_init();
+    printf(tab_mode ? "size\tKops\tbatchKops\tspeedup\n"
+                    : "%7s %8s %9s %7s\n", "size", "Kops", "batchKops", "speedup");
+    for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+        double secs, bsecs;
+
+        b.size = sizes[i];
+        b.batch = false;
+        secs = fsec(eval_mm_batch, &b);
+        b.batch = true;
+        bsecs = fsec(eval_mm_batch, &b);
+        printf(tab_mode ? "%zu\t%.0f\t%.0f\t%.3f\n" : "%7zu %8.0f %9.0f %7.3f\n",
+               sizes[i], ops * 1e-3 / secs, ops * 1e-3 / bsecs, secs / bsecs);
+    }
+    mem_deinit();
+}
+
+/*
+ * eval_mm_heap - This is the function that is used by fcyc() to time
+ *    one size and one way of freeing in the mm_heap microbenchmark.
+ */
+static void eval_mm_heap(void *ptr)
+{
+    heap_bench_t *b = ptr;
+    mm_heap *heap = NULL;
+    void *mark = NULL;
+    int i, round;
+
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("mm_init failed in eval_mm_heap");
+    if ((b->how == HEAP_RELEASE || b->how == HEAP_REUSE)
+        && (heap = mm_heap_create()) == NULL)
+        app_error("mm_heap_create failed in eval_mm_heap");
+
+    for (round = 0; round < BATCH_ROUNDS; round++) {
+        if (b->how == HEAP_DESTROY && (heap = mm_heap_create()) == NULL)
+            app_error("mm_heap_create failed in eval_mm_heap");
+        if (b->how == HEAP_RELEASE)
+            mark = mm_heap_mark(heap);
+
+        for (i = 0; i < BATCH_N; i++) {
+            b->ptrs[i] = b->how == HEAP_FREE ? mm_malloc(b->size)
+                                             : mm_heap_malloc(heap, b->size);
+            if (b->ptrs[i] == NULL)
+                app_error("allocation error in eval_mm_heap");
+            *(char *)b->ptrs[i] = 1;
+        }
+
+        if (b->how == HEAP_FREE) {
+            for (i = 0; i < BATCH_N; i++)
+                mm_free(b->ptrs[i]);
+        } else if (b->how == HEAP_REUSE) {
+            for (i = 0; i < BATCH_N; i++)
+                mm_heap_free(heap, b->ptrs[i], b->size);
+        } else if (b->how == HEAP_DESTROY)
+            mm_heap_destroy(heap);
+        else
+            mm_heap_release(heap, mark);
+    }
+    if (b->how == HEAP_RELEASE || b->how == HEAP_REUSE)
+        mm_heap_destroy(heap);
+}
+
+/*
+ * run_heap_bench - times the mm_heap microbenchmark for a range of
+ *    object sizes and prints the results
+ */
+static void run_heap_bench(void)
+{
+    static const size_t sizes[] = { 16, 64, 256, 1024, 4096 };
+    static void *ptrs[BATCH_N];
+    heap_bench_t b = { 0, HEAP_FREE, ptrs };
+    double ops = 2.0 * BATCH_N * BATCH_ROUNDS;
+    int i;
+
+    mem_init();
+    printf(tab_mode ? "size\tKops\tdestroyKops\treleaseKops\treuseKops\n"
+                    : "%7s %8s %11s %11s %11s\n",
+           "size", "Kops", "destroyKops", "releaseKops", "reuseKops");
+    for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+        double secs, dsecs, rsecs, usecs;
+
+        b.size = sizes[i];
+        b.how = HEAP_FREE;
+        secs = fsec(eval_mm_heap, &b);
+        b.how = HEAP_DESTROY;
+        dsecs = fsec(eval_mm_heap, &b);
+        b.how = HEAP_RELEASE;
+        rsecs = fsec(eval_mm_heap, &b);
+        b.how = HEAP_REUSE;
+        usecs = fsec(eval_mm_heap, &b);
+        printf(tab_mode ? "%zu\t%.0f\t%.0f\t%.0f\t%.0f\n"
+                        : "%7zu %8.0f %11.0f %11.0f %11.0f\n",
+               sizes[i], ops * 1e-3 / secs, ops * 1e-3 / dsecs, ops * 1e-3 / rsecs,
+               ops * 1e-3 / usecs);
+    }
+    mem_deinit();
+}
+
+/*
+ * eval_mm_calloc - This is the function that is used by fcyc() to time
+ *    one size of the calloc microbenchmark.
+ */
+static void eval_mm_calloc(void *ptr)
+{
+    calloc_bench_t *b = ptr;
+    size_t i, n = CALLOC_BYTES / b->size;
+    char *p;
+
+    mem_reset_brk();
+    mem_release_top();
+    if (!mm_init())
+        app_error("mm_init failed in eval_mm_calloc");
+
+    for (i = 0; i < n; i++) {
+        if (b->calloc)
+            p = mm_calloc(1, b->size);
+        else if ((p = mm_malloc(b->size)) != NULL)
+            memset(p, 0, b->size);
+        if (p == NULL)
+            app_error("allocation error in eval_mm_calloc");
+        p[0] = 1;
+    }
+}
+
+/*
+ * check_calloc - checks that mm_calloc clears objects of the given
+ *    size, both in a fresh heap and when reusing freed blocks
+ */
+static void check_calloc(size_t size)
+{
+    static char *ptrs[CALLOC_BYTES / 64];
+    size_t i, j, n = CALLOC_BYTES / size;
+
+    mem_reset_brk();
+    mem_release_top();
+    if (!mm_init())
+        app_error("mm_init failed in check_calloc");
+    for (j = 0; j < 2; j++) {
+        for (i = j; i < n; i += j + 1) {
+            char *p = ptrs[i] = mm_calloc(1, size);
+
+            if (p == NULL)
+                app_error("mm_calloc failed for %zu bytes", size);
+            if (p[0] != 0 || memcmp(p, p + 1, size - 1) != 0)
+                app_error("mm_calloc returned %zu bytes not all zero", size);
+            memset(p, 0xff, size);
+        }
+        /* Free every other object to be handed out again */
+        for (i = 1; j == 0 && i < n; i += 2)
+            mm_free(ptrs[i]);
+    }
+    if (mm_calloc(SIZE_MAX / 2, 3) != NULL)
+        app_error("mm_calloc did not detect overflow");
+}
+
+/*
+ * run_calloc_bench - times the calloc microbenchmark for a range of
+ *    object sizes and prints the results
+ */
+static void run_calloc_bench(void)
+{
+    static const size_t sizes[] = { 64, 512, 4096, 65536, 1 << 20 };
+    calloc_bench_t b = { 0, false };
+    int i;
+
+    mem_init();
+    printf(tab_mode ? "size\tKops\tcallocKops\tspeedup\n"
+                    : "%7s %8s %10s %7s\n", "size", "Kops", "callocKops", "speedup");
+    for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+        double ops = CALLOC_BYTES / sizes[i], secs, csecs;
+
+        check_calloc(sizes[i]);
+        b.size = sizes[i];
+        b.calloc = false;
+        secs = fsec(eval_mm_calloc, &b);
+        b.calloc = true;
+        csecs = fsec(eval_mm_calloc, &b);
+        printf(tab_mode ? "%zu\t%.0f\t%.0f\t%.3f\n" : "%7zu %8.0f %10.0f %7.3f\n",
+               sizes[i], ops * 1e-3 / secs, ops * 1e-3 / csecs, secs / csecs);
+    }
+    mem_deinit();
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -1342,6 +1842,15 @@ static bool eval_libc_valid(trace_t *trace)
                 trace->blocks[trace->ops[i].index] = p;
                 break;
 
+            case MEMALIGN: /* posix_memalign */
+                if (posix_memalign((void **)&p, trace->ops[i].align,
+                                   trace->ops[i].size) != 0) {
+                    malloc_error(trace, i, "libc posix_memalign failed");
+                    unix_error("System message");
+                }
+                trace->blocks[trace->ops[i].index] = p;
+                break;
+
             case REALLOC: /* realloc */
                 newsize = trace->ops[i].size;
                 oldp = trace->blocks[trace->ops[i].index];
@@ -1393,6 +1902,14 @@ static void eval_libc_speed(void *ptr)
                 trace->blocks[index] = p;
                 break;
 
+            case MEMALIGN: /* posix_memalign */
+                index = trace->ops[i].index;
+                size = trace->ops[i].size;
+                if (posix_memalign((void **)&p, trace->ops[i].align, size) != 0)
+                    unix_error("posix_memalign failed in eval_libc_speed");
+                trace->blocks[index] = p;
+                break;
+
             case REALLOC: /* realloc */
                 index = trace->ops[i].index;
                 newsize = trace->ops[i].size;
@@ -1433,6 +1950,7 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
     double sumsecs = 0;
     double sumops  = 0;
     double sumutil = 0;
+    double sumsbrks = 0;
     int sum_perf_weight = 0;
     int sum_util_weight = 0;
 
@@ -1441,10 +1959,11 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
 
     /* Print the individual results for each trace */
     if (tab_mode) {
-        printf("valid\tthru?\tutil?\tutil\tops\tmsecs\tKops\ttrace\n");
+        printf("valid\tthru?\tutil?\tutil\tops\tmsecs\tKops\tsbrks\tpeakKB\tfinalKB\tqhit\ttrace\n");
     } else {
-        printf("  %5s  %6s %7s%8s%8s  %s\n",
-               "valid", "util", "ops", "msecs", "Kops", "trace");
+        printf("  %5s  %6s %7s%8s%8s%7s%8s%8s%7s  %s\n",
+               "valid", "util", "ops", "msecs", "Kops", "sbrks",
+               "peakKB", "finalKB", "qhit", "trace");
     }
     for (i=0; i < n; i++) {
         if (stats[i].valid) {
@@ -1507,6 +2026,22 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
                     printf("%8s%10s%7s ", "--", "--", "--");
             }
 
+            /* Heap growth */
+            if (tab_mode)
+                printf("%.0f\t%.0f\t%.0f\t", stats[i].sbrks,
+                       stats[i].peak_kb, stats[i].final_kb);
+            else
+                printf("%6.0f %7.0f %7.0f ", stats[i].sbrks,
+                       stats[i].peak_kb, stats[i].final_kb);
+
+            /* Quick list hit rate */
+            if (stats[i].quick_hit < 0)
+                printf(tab_mode ? "-\t" : "%6s ", "-");
+            else if (tab_mode)
+                printf("%.1f\t", stats[i].quick_hit * 100.0);
+            else
+                printf("%5.1f%% ", stats[i].quick_hit * 100.0);
+
             printf("%s\n", stats[i].filename);
 
             if (stats[i].weight == WALL || stats[i].weight == WPERF)
@@ -1520,18 +2055,23 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
                 sum_util_weight += 1;
                 sumutil += stats[i].util;
             }
+            sumsbrks += stats[i].sbrks;
         }
         else {
             if (tab_mode) {
-                printf("no\t\t\t\t\t\t\t%s\n", stats[i].filename);
+                printf("no\t\t\t\t\t\t\t\t\t\t\t%s\n", stats[i].filename);
             } else {
-                printf("%2s%4s%7s%10s%7s%10s %s\n",
+                printf("%2s%4s%7s%10s%7s%10s%7s%8s%8s%7s %s\n",
                        stats[i].weight != 0 ? "*" : "",
                        "no",
                        "-",
                        "-",
                        "-",
                        "-",
+                       "-",
+                       "-",
+                       "-",
+                       "-",
                        stats[i].filename);
             }
         }
@@ -1547,19 +2087,21 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
         double util = (sumutil/(double)sum_util_weight)*100.0;
         double tput = (sumsecs==0.0) ? 0 : (sumops/1e3)/sumsecs;
         if (tab_mode) {
-            // "valid\tthru?\tutil?\tutil\tops\tmsecs\tKops\ttrace"
-            printf("Sum\t%d\t%d\t%.1f\t%.0f\t\%.2f\n",
-                   sum_perf_weight, sum_util_weight, sumutil*100.0, sumops, sumsecs * 1000.0);
+            // "valid\tthru?\tutil?\tutil\tops\tmsecs\tKops\tsbrks\tpeakKB\tfinalKB\tqhit\ttrace"
+            printf("Sum\t%d\t%d\t%.1f\t%.0f\t\%.2f\t\t%.0f\n",
+                   sum_perf_weight, sum_util_weight, sumutil*100.0, sumops, sumsecs * 1000.0,
+                   sumsbrks);
             printf("Avg\t\t\t%.1f\t\t\t%.0f\n",
                    util, tput);
         } else {
-            printf("%2d %2d  %7.1f%%%8.0f%10.3f%7.0f\n",
+            printf("%2d %2d  %7.1f%%%8.0f%10.3f%7.0f%7.0f\n",
                    sum_util_weight,
                    sum_perf_weight,
                    util,
                    sumops,
                    sumsecs * 1000.0,
-                   tput);
+                   tput,
+                   sumsbrks);
         }
 
         /* Record the summary statistics so we can compare libc and
@@ -1586,6 +2128,163 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
     }
 }
 
+/*
+ * printallocstats - for each valid trace, prints the mm_stats operation
+ *                   counts, free space and realloc copy bytes, copied
+ *                   and saved by growth prediction, at the end of its
+ *                   utilization run, then its mallocs by nonzero size
+ *                   class
+ */
+static void printallocstats(int n, stats_t *stats)
+{
+    int i, c, b;
+
+    printf(tab_mode ? "mallocs\tfrees\tsplits\tcoal1\tcoal2\tcoal3\tcoal4\textends\tfreeblks\tfreeKB\tusedKB\tcopyKB\tsavedKB\ttrace\n"
+                    : "%8s %8s %7s %7s %7s %7s %7s %7s %8s %7s %7s %8s %8s  %s\n",
+           "mallocs", "frees", "splits", "coal1", "coal2", "coal3", "coal4",
+           "extends", "freeblks", "freeKB", "usedKB", "copyKB", "savedKB", "trace");
+    for (i = 0; i < n; i++) {
+        struct mm_stats *a = &stats[i].alloc;
+        size_t mallocs = 0, frees = 0;
+        size_t blocks = a->tree_blocks + a->mini_blocks + a->quick_blocks;
+
+        if (!stats[i].valid)
+            continue;
+        for (c = 0; c < MM_STATS_CLASSES; c++) {
+            mallocs += a->mallocs[c];
+            frees += a->frees[c];
+        }
+        for (b = 0; b < MM_STATS_BINS; b++)
+            blocks += a->bin_blocks[b];
+        printf(tab_mode ? "%zu\t%zu\t%zu\t%zu\t%zu\t%zu\t%zu\t%zu\t%zu\t%.1f\t%.1f\t%.1f\t%.1f\t%s\n"
+                        : "%8zu %8zu %7zu %7zu %7zu %7zu %7zu %7zu %8zu %7.1f %7.1f %8.1f %8.1f  %s\n",
+               mallocs, frees, a->splits, a->coalesces[0], a->coalesces[1],
+               a->coalesces[2], a->coalesces[3], a->extends, blocks,
+               a->free_bytes / 1024.0, a->used_bytes / 1024.0,
+               a->realloc_copied / 1024.0, a->realloc_saved / 1024.0,
+               stats[i].filename);
+    }
+
+    printf("\nMallocs by size class:\n");
+    for (i = 0; i < n; i++) {
+        struct mm_stats *a = &stats[i].alloc;
+
+        if (!stats[i].valid)
+            continue;
+        printf(tab_mode ? "%s" : "%-24s", stats[i].filename);
+        for (c = 0; c < MM_STATS_CLASSES; c++) {
+            if (!a->mallocs[c])
+                continue;
+            if (c == MM_STATS_CLASSES - 1)
+                printf(tab_mode ? "\thuge:%zu" : " huge:%zu", a->mallocs[c]);
+            else
+                printf(tab_mode ? "\t%zu:%zu" : " %zu:%zu", (size_t)16 << c, a->mallocs[c]);
+        }
+        printf("\n");
+    }
+}
+
+/*
+ * printsized - for each valid trace with a throughput weight, prints
+ *              the throughput with plain and with sized frees
+ */
+static void printsized(int n, stats_t *stats)
+{
+    double sumops = 0, sumsecs = 0, sumsized = 0;
+
+    printf(tab_mode ? "Kops\tsizedKops\tspeedup\ttrace\n"
+                    : "%7s %9s %7s  trace\n", "Kops", "sizedKops", "speedup");
+    for (int i = 0; i < n; i++) {
+        if (!stats[i].valid || stats[i].weight == WUTIL)
+            continue;
+        double kops = (stats[i].ops*1e-3)/stats[i].secs;
+        double sized = (stats[i].ops*1e-3)/stats[i].sized_secs;
+        printf(tab_mode ? "%.0f\t%.0f\t%.3f\t%s\n" : "%7.0f %9.0f %7.3f  %s\n",
+               kops, sized, sized / kops, stats[i].filename);
+        if (stats[i].weight == WALL || stats[i].weight == WPERF) {
+            sumops += stats[i].ops;
+            sumsecs += stats[i].secs;
+            sumsized += stats[i].sized_secs;
+        }
+    }
+    if (sumsecs > 0 && sumsized > 0)
+        printf(tab_mode ? "%.0f\t%.0f\t%.3f\tAverage\n" : "%7.0f %9.0f %7.3f  Average\n",
+               sumops*1e-3/sumsecs, sumops*1e-3/sumsized, sumsecs / sumsized);
+}
+
+/*
+ * runmatrix - runs the traces once for each of cols columns, set picking
+ *             the column, and for each trace valid in every column prints
+ *             the utilization and throughput in each
+ */
+static void runmatrix(const char *title, int cols, const char **labels,
+                      void (*set)(int col), int n, const char *tracedir,
+                      char **tracefiles, speed_t *speed_params)
+{
+    stats_t *stats[MATRIX_MAX];
+    double util[MATRIX_MAX] = {0}, secs[MATRIX_MAX] = {0}, ops = 0;
+    int nutil = 0, c, i;
+
+    assert(cols <= MATRIX_MAX);
+    for (c = 0; c < cols; c++) {
+        stats[c] = calloc(n, sizeof(stats_t));
+        if (stats[c] == NULL)
+            unix_error("matrix stats calloc in runmatrix failed");
+        set(c);
+        run_tests(n, tracedir, tracefiles, stats[c], speed_params);
+    }
+
+    printf("%s:\n", title);
+    for (c = 0; c < cols; c++)
+        printf(tab_mode ? "%sutil\t%sKops\t" : "%6sutil %6sKops ",
+               labels[c], labels[c]);
+    printf(tab_mode ? "trace\n" : " trace\n");
+    for (i = 0; i < n; i++) {
+        for (c = 0; c < cols && stats[c][i].valid; c++)
+            ;
+        if (c < cols)
+            continue;
+        for (c = 0; c < cols; c++)
+            printf(tab_mode ? "%.1f%%\t%.0f\t" : "%9.1f%% %10.0f ",
+                   stats[c][i].util * 100.0, (stats[c][i].ops*1e-3)/stats[c][i].secs);
+        printf(tab_mode ? "%s\n" : " %s\n", stats[0][i].filename);
+        if (stats[0][i].weight == WALL || stats[0][i].weight == WUTIL) {
+            for (c = 0; c < cols; c++)
+                util[c] += stats[c][i].util;
+            nutil++;
+        }
+        if (stats[0][i].weight == WALL || stats[0][i].weight == WPERF) {
+            ops += stats[0][i].ops;
+            for (c = 0; c < cols; c++)
+                secs[c] += stats[c][i].secs;
+        }
+    }
+    if (nutil > 0) {
+        for (c = 0; c < cols; c++)
+            printf(tab_mode ? "%.1f%%\t%.0f\t" : "%9.1f%% %10.0f ",
+                   util[c] / nutil * 100.0, secs[c] > 0 ? ops*1e-3/secs[c] : 0);
+        printf(tab_mode ? "Average\n" : " Average\n");
+    }
+    for (c = 0; c < cols; c++)
+        free(stats[c]);
+}
+
+/* Matrix setters for the free list order, fit policy and split threshold */
+static void set_order(int col)
+{
+    mm_set_free_order(col ? MM_ORDER_ADDRESS : MM_ORDER_LIFO);
+}
+
+static void set_policy(int col)
+{
+    mm_set_policy((enum mm_policy)col);
+}
+
+static void set_split(int col)
+{
+    mm_set_split_threshold(split_thresholds[col]);
+}
+
 /*
  * app_error - Report an arbitrary application error
  */
@@ -1808,5 +2507,13 @@ static void usage(char *prog)
     fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
     fprintf(stderr, "\t-T         Print diagnostics in tab mode\n");
+    fprintf(stderr, "\t-A         Print allocator statistics for each trace\n");
+    fprintf(stderr, "\t-F         Rerun the traces with address-ordered free lists\n");
+    fprintf(stderr, "\t-P         Rerun the traces under every fit policy\n");
+    fprintf(stderr, "\t-X         Rerun the traces at several split thresholds\n");
+    fprintf(stderr, "\t-S         Also time each trace freeing with mm_free_sized\n");
+    fprintf(stderr, "\t-B         Time mm_malloc_batch/mm_free_batch against single calls\n");
+    fprintf(stderr, "\t-H         Time mm_heap destroy, release and free against mm_free\n");
+    fprintf(stderr, "\t-Z         Time mm_calloc against mm_malloc and memset\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file\n");
 }
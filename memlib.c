@@ -4,6 +4,7 @@
  * package with the system's malloc package in libc.
  *
  */
+#define _GNU_SOURCE                         /* for mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -22,6 +23,22 @@
 static unsigned char *heap;                 /* Starting address of heap */
 static unsigned char *mem_brk;              /* Current position of break */
 static unsigned char *mem_max_addr;         /* Maximum allowable heap address */
+static unsigned char *mem_clean;            /* Bytes from here to mem_max_addr read as zero */
+static size_t mem_peak;                     /* Largest heap plus mapped size since the last reset */
+static size_t sbrk_calls;                   /* Calls to mem_sbrk since the last reset */
+
+/* Regions handed out by mem_map, outside the heap */
+typedef struct {
+    unsigned char *addr;
+    size_t len;
+} mapping_t;
+
+static mapping_t *maps;                     /* Live mappings, in no order */
+static size_t nmaps, maps_cap;
+static size_t map_bytes;                    /* Sum of their lengths */
+static bool maps_lock;                      /* Spin lock guarding the above */
+
+static void mem_unmap_all(void);
 
 /* 
  * mem_init - initialize the memory system model
@@ -39,6 +56,7 @@ void mem_init(){
     }
     heap = addr;
     mem_max_addr = addr + MAX_HEAP_SIZE;
+    mem_clean = addr;
     mem_reset_brk();
 }
 
@@ -46,6 +64,10 @@ void mem_init(){
  * mem_deinit - free the storage used by the memory system model
  */
 void mem_deinit(void){
+    mem_unmap_all();
+    free(maps);
+    maps = NULL;
+    maps_cap = 0;
     if (munmap(heap, MAX_HEAP_SIZE) != 0) {
         fprintf(stderr, "FAILURE.  munmap couldn't deallocate heap space\n");
         exit(1);
@@ -53,36 +75,271 @@ void mem_deinit(void){
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_unmap_all - unmap every region still mapped with mem_map
+ */
+static void mem_unmap_all(void) {
+    for (size_t i = 0; i < nmaps; i++)
+	munmap(maps[i].addr, maps[i].len);
+    nmaps = 0;
+    map_bytes = 0;
+}
+
+/*
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap,
+ *      and unmap whatever an earlier run left mapped
  */
 void mem_reset_brk(){
+    mem_unmap_all();
     mem_brk = heap;
+    mem_peak = 0;
+    sbrk_calls = 0;
+}
+
+/*
+ * mem_note_peak - raise mem_peak to the current heap plus mapped size
+ */
+static void mem_note_peak(void) {
+    size_t size = mem_heapsize() + __atomic_load_n(&map_bytes, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&mem_peak, __ATOMIC_RELAXED);
+
+    while (size > peak &&
+	   !__atomic_compare_exchange_n(&mem_peak, &peak, size, true,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	;
+}
+
+/*
+ * mem_release - hand the whole pages in [lo, hi) back to the kernel and
+ *      clear the bytes of partial pages at either end, so that all of
+ *      [lo, hi) reads as zero if the heap grows over it again.
+ */
+static void mem_release(unsigned char *lo, unsigned char *hi) {
+    uintptr_t page = (uintptr_t) getpagesize();
+    uintptr_t start = ((uintptr_t) lo + page - 1) & ~(page - 1);
+    uintptr_t end = (uintptr_t) hi & ~(page - 1);
+
+    if (start >= end) {
+	memset(lo, 0, hi - lo);
+	return;
+    }
+    memset(lo, 0, (unsigned char *) start - lo);
+    memset((unsigned char *) end, 0, hi - (unsigned char *) end);
+    if (madvise((void *) start, end - start, MADV_DONTNEED) != 0)
+	fprintf(stderr, "WARNING: madvise failed releasing %p..%p\n",
+		(void *) start, (void *) end);
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *		by incr bytes and returns the start address of the new area. In
- *		this model, the heap cannot be shrunk.
+ *		by incr bytes and returns the start address of the new area.
+ *		A negative incr shrinks the heap and returns the old break;
+ *		the bytes given back read as zero if it grows over them again.
  */
 void *mem_sbrk(intptr_t incr) {
-    unsigned char *old_brk = mem_brk;
+    unsigned char *old_brk = __atomic_load_n(&mem_brk, __ATOMIC_RELAXED);
+
+    /* Lock-free, so threads may call it concurrently */
+    __atomic_add_fetch(&sbrk_calls, 1, __ATOMIC_RELAXED);
+    do {
+	if (incr < 0 && old_brk + incr < heap) {
+	    fprintf(stderr, "ERROR: mem_sbrk failed.  Attempt to shrink heap by %ld below its start\n", (long) -incr);
+	    errno = ENOMEM;
+	    return (void *) -1;
+	}
+	if (old_brk + incr > mem_max_addr) {
+	    long alloc = old_brk - heap + incr;
+	    fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory.  Would require heap size of %zd (0x%zx) bytes\n", alloc, alloc);
+	    errno = ENOMEM;
+	    return (void *) -1;
+	}
+    } while (!__atomic_compare_exchange_n(&mem_brk, &old_brk, old_brk + incr, true,
+					  __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
 
-    bool ok = true;
+    if (incr > 0) {
+	unsigned char *clean = __atomic_load_n(&mem_clean, __ATOMIC_RELAXED);
+
+	while (clean < old_brk + incr &&
+	       !__atomic_compare_exchange_n(&mem_clean, &clean, old_brk + incr, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	    ;
+	mem_note_peak();
+    }
     if (incr < 0) {
-	ok = false;
-	fprintf(stderr, "ERROR: mem_sbrk failed.  Attempt to expand heap by negative value %ld\n", (long) incr);
-    } else if (mem_brk + incr > mem_max_addr) {
-	ok = false;
-	long alloc = mem_brk - heap + incr;
-	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory.  Would require heap size of %zd (0x%zx) bytes\n", alloc, alloc);
+	unsigned char *clean = old_brk;
+
+	mem_release(old_brk + incr, old_brk);
+	__atomic_compare_exchange_n(&mem_clean, &clean, old_brk + incr, false,
+				    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+    return (void *) old_brk;
+}
+
+/*
+ * mem_zero_lo - return the address from which the heap area, at and
+ *      beyond the break, is known to read as zero, as fresh sbrk memory
+ *      does.  It lies above the break when the heap was reset without
+ *      its pages being given back.
+ */
+void *mem_zero_lo(void) {
+    return __atomic_load_n(&mem_clean, __ATOMIC_RELAXED);
+}
+
+/*
+ * mem_release_top - give back the pages above the break, so the heap
+ *      grows into zero pages again as in a fresh process
+ */
+void mem_release_top(void) {
+    if (mem_clean > mem_brk)
+	mem_release(mem_brk, mem_clean);
+    mem_clean = mem_brk;
+}
+
+static void maps_acquire(void) {
+    while (__atomic_test_and_set(&maps_lock, __ATOMIC_ACQUIRE))
+	;
+}
+
+static void maps_release(void) {
+    __atomic_clear(&maps_lock, __ATOMIC_RELEASE);
+}
+
+/* Returns the table index of the mapping at addr, or nmaps */
+static size_t map_find(const void *addr) {
+    size_t i;
+
+    for (i = 0; i < nmaps; i++)
+	if (maps[i].addr == addr)
+	    break;
+    return i;
+}
+
+/* Enters the new mapping [addr, addr + len) in the table */
+static void *map_record(unsigned char *addr, size_t len) {
+    mapping_t *grown;
+
+    maps_acquire();
+    if (nmaps == maps_cap) {
+	size_t cap = maps_cap ? 2 * maps_cap : 64;
+
+	if ((grown = realloc(maps, cap * sizeof(mapping_t))) == NULL) {
+	    maps_release();
+	    munmap(addr, len);
+	    return NULL;
+	}
+	maps = grown;
+	maps_cap = cap;
     }
-    if (ok) {
-	mem_brk += incr;
-	return (void *) old_brk;
-    } else {
-	errno = ENOMEM;
-	return (void *) -1;
+    maps[nmaps].addr = addr;
+    maps[nmaps++].len = len;
+    __atomic_store_n(&map_bytes, map_bytes + len, __ATOMIC_RELAXED);
+    maps_release();
+    mem_note_peak();
+    return addr;
+}
+
+/*
+ * mem_map - simple model of an anonymous mmap.  Maps len bytes, a
+ *      multiple of the page size, of zeroed memory outside the heap and
+ *      returns its address, or NULL if it cannot.  Each region is
+ *      separate from the heap and from every other one.
+ */
+void *mem_map(size_t len) {
+    unsigned char *addr;
+
+    addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED) {
+	fprintf(stderr, "ERROR: mem_map failed.  Could not map %zu bytes\n", len);
+	return NULL;
+    }
+    return map_record(addr, len);
+}
+
+/*
+ * mem_map_aligned - like mem_map, but places the region so that its
+ *      address plus skew, a multiple of the page size, is a multiple of
+ *      align, a power of two.  The excess on either side is unmapped.
+ */
+void *mem_map_aligned(size_t len, size_t align, size_t skew) {
+    unsigned char *raw, *addr;
+
+    raw = mmap(NULL, len + align, PROT_READ | PROT_WRITE,
+	       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (raw == MAP_FAILED) {
+	fprintf(stderr, "ERROR: mem_map failed.  Could not map %zu bytes\n", len + align);
+	return NULL;
     }
+    addr = (unsigned char *)
+	(((uintptr_t) raw + skew + align - 1) & ~(uintptr_t)(align - 1)) - skew;
+    if (addr > raw)
+	munmap(raw, addr - raw);
+    if (addr < raw + align)
+	munmap(addr + len, raw + align - addr);
+    return map_record(addr, len);
+}
+
+/*
+ * mem_unmap - give back the region at addr that mem_map returned, with
+ *      the same len.  Its pages go straight back to the kernel.
+ */
+void mem_unmap(void *addr, size_t len) {
+    size_t i;
+
+    maps_acquire();
+    i = map_find(addr);
+    assert(i < nmaps && maps[i].len == len);
+    maps[i] = maps[--nmaps];
+    __atomic_store_n(&map_bytes, map_bytes - len, __ATOMIC_RELAXED);
+    maps_release();
+    if (munmap(addr, len) != 0)
+	fprintf(stderr, "WARNING: munmap failed releasing %p\n", addr);
+}
+
+/*
+ * mem_remap - simple model of mremap.  Resizes the region at addr from
+ *      oldlen to newlen bytes, moving it if it must, and returns its new
+ *      address, or NULL leaving it untouched if it cannot.
+ */
+void *mem_remap(void *addr, size_t oldlen, size_t newlen) {
+    unsigned char *newaddr;
+    size_t i;
+
+    maps_acquire();
+    i = map_find(addr);
+    assert(i < nmaps && maps[i].len == oldlen);
+    newaddr = mremap(addr, oldlen, newlen, MREMAP_MAYMOVE);
+    if (newaddr == MAP_FAILED) {
+	maps_release();
+	fprintf(stderr, "ERROR: mem_remap failed.  Could not map %zu bytes\n", newlen);
+	return NULL;
+    }
+    maps[i].addr = newaddr;
+    maps[i].len = newlen;
+    __atomic_store_n(&map_bytes, map_bytes - oldlen + newlen, __ATOMIC_RELAXED);
+    maps_release();
+    mem_note_peak();
+    return newaddr;
+}
+
+/*
+ * mem_mapsize() - returns the bytes currently mapped with mem_map
+ */
+size_t mem_mapsize() {
+    return __atomic_load_n(&map_bytes, __ATOMIC_RELAXED);
+}
+
+/*
+ * mem_in_map - returns whether [lo, hi] lies inside one mapped region
+ */
+bool mem_in_map(const void *lo, const void *hi) {
+    bool found = false;
+
+    maps_acquire();
+    for (size_t i = 0; i < nmaps && !found; i++)
+	found = (const unsigned char *) lo >= maps[i].addr &&
+	    (const unsigned char *) hi < maps[i].addr + maps[i].len;
+    maps_release();
+    return found;
 }
 
 /*
@@ -96,14 +353,30 @@ void *mem_heap_lo(){
  * mem_heap_hi - return address of last heap byte
  */
 void *mem_heap_hi(){
-    return (void *)(mem_brk - 1);
+    return (void *)(__atomic_load_n(&mem_brk, __ATOMIC_ACQUIRE) - 1);
 }
 
 /*
  * mem_heapsize() - returns the heap size in bytes
  */
 size_t mem_heapsize() {
-    return (size_t)(mem_brk - heap);
+    return (size_t)(__atomic_load_n(&mem_brk, __ATOMIC_ACQUIRE) - heap);
+}
+
+/*
+ * mem_heap_peak() - returns the largest heap size in bytes, counting
+ *      mapped regions too, since the break was last reset
+ */
+size_t mem_heap_peak() {
+    return mem_peak;
+}
+
+/*
+ * mem_sbrk_calls() - returns the number of mem_sbrk calls since the
+ *      break was last reset
+ */
+size_t mem_sbrk_calls() {
+    return sbrk_calls;
 }
 
 /*
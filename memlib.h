@@ -9,7 +9,19 @@ void mem_reset_brk(void);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_heap_peak(void);
+size_t mem_sbrk_calls(void);
 size_t mem_pagesize(void);
+void *mem_zero_lo(void);
+void mem_release_top(void);
+
+/* Regions mapped outside the heap, as with mmap and munmap */
+void *mem_map(size_t len);
+void *mem_map_aligned(size_t len, size_t align, size_t skew);
+void mem_unmap(void *addr, size_t len);
+void *mem_remap(void *addr, size_t oldlen, size_t newlen);
+size_t mem_mapsize(void);
+bool mem_in_map(const void *lo, const void *hi);
 
 /* Functions used for memory emulation */
 
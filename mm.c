@@ -9,6 +9,7 @@
  *
  */
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,6 +20,10 @@
 #include "mm.h"
 #include "memlib.h"
 
+#ifdef MM_THREADS
+#include <pthread.h>
+#endif
+
 /*
  * If you want to enable your debugging output and heap checker code,
  * uncomment the following line. Be sure not to have debugging enabled
@@ -43,6 +48,14 @@
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define memalign mm_memalign
+#define aligned_alloc mm_aligned_alloc
+#define posix_memalign mm_posix_memalign
+#define free_sized mm_free_sized
+#define malloc_usable_size mm_malloc_usable_size
+#define malloc_good_size mm_good_size
+#define malloc_batch mm_malloc_batch
+#define free_batch mm_free_batch
 #define memset mem_memset
 #define memcpy mem_memcpy
 #endif /* DRIVER */
@@ -50,6 +63,8 @@
 static void printFree(void);
 static void printHeap(void);
 static size_t get_free_index ( size_t bsize );
+static size_t GET_SIZE(size_t* p);
+static void* HDRP(void *bp);
 
 typedef struct free_list {
     void * bp;
@@ -58,32 +73,307 @@ typedef struct free_list {
 
 static char *heap_listp = 0;
 
+/*
+ * Free blocks are kept in TLSF (two-level segregated fit) lists.  The
+ * first level splits block sizes by power of two, the second level
+ * splits each power-of-two range into SL_COUNT linear classes.  Blocks
+ * smaller than SMALL_BLOCK all share first level 0 with one class per
+ * ALIGNMENT step.  fl_bitmap has a bit set for every first level that
+ * holds a non-empty list and sl_bitmap[fl] does the same for its
+ * second level classes, so a good fit is found with two bit scans.
+ * Only blocks up to LARGE_BLOCK bytes go into these lists.
+ */
+enum {
+    ALIGN_LOG2  = 4,
+    SL_LOG2     = 4,
+    SL_COUNT    = 1 << SL_LOG2,
+    FL_SHIFT    = SL_LOG2 + ALIGN_LOG2,
+    SMALL_BLOCK = 1 << FL_SHIFT,
+    LARGE_LOG2  = 12,
+    LARGE_BLOCK = 1 << LARGE_LOG2,
+    FL_COUNT    = LARGE_LOG2 - FL_SHIFT + 2,
+    BIN_LEN     = FL_COUNT * SL_COUNT
+};
+
+static size_t * free_head[BIN_LEN];
+
+/*
+ * With MM_ORDER_ADDRESS each list is kept sorted by address, so a fit
+ * takes the lowest block of its class and live blocks pack towards the
+ * bottom of the heap.  A sorted insert would walk the list from its
+ * head; instead it starts at free_finger, the block last linked into
+ * that list, and walks up or down from there, which is short because a
+ * block is mostly freed close to the one freed before it.
+ */
+static enum mm_free_order free_order, free_order_next;
+static size_t * free_finger[BIN_LEN];
+
+/*
+ * Placement policy, see list_fit.  Next fit resumes its search of a
+ * list at free_rover, which follows the block it last took; good fit
+ * gives up after GOOD_FIT_TRIES blocks.
+ */
+static enum mm_policy fit_policy, fit_policy_next;
+static bool fit_policy_set;
+static size_t * free_rover[BIN_LEN];
+
+static const char *policy_names[MM_POLICIES] = { "good", "first", "next", "best" };
+
+enum {
+    GOOD_FIT_TRIES = 4
+};
+
+/*
+ * Under good and best fit with LIFO lists, every ranged class (one
+ * whose blocks differ in size) also keeps its blocks in a fit_index,
+ * one cache line of FIDX_SLOTS (size, offset) pairs.  A search then
+ * compares all the sizes with a few vector instructions instead of
+ * reading the header of each block on the list.  The offset is in
+ * ALIGNMENT units from heap_lo and an empty slot has size 0.  A block
+ * linked while all slots are taken is left out and counted in
+ * fidx_spill, so the index covers the whole list while that is zero.
+ */
+enum {
+    FIDX_SLOTS = 8,
+    FIDX_FIRST = SMALL_BLOCK >> ALIGN_LOG2
+};
+
+typedef struct fit_index {
+    uint32_t size[FIDX_SLOTS];
+    uint32_t off[FIDX_SLOTS];
+} __attribute__ ((aligned (64))) fit_index;
+
+/* Four lanes, so the vector code needs nothing past SSE2 or NEON */
+typedef uint32_t fidx_vec __attribute__ ((vector_size (16)));
+typedef int32_t fidx_mask __attribute__ ((vector_size (16)));
+
+static bool fidx_on;
+static fit_index fidx[BIN_LEN - FIDX_FIRST];
+static size_t fidx_spill[BIN_LEN - FIDX_FIRST];
+
+_Static_assert ( BIN_LEN == MM_STATS_BINS, "MM_STATS_BINS must match BIN_LEN" );
+
+static uint64_t fl_bitmap;
+static uint32_t sl_bitmap[FL_COUNT];
+
+/*
+ * Free blocks larger than LARGE_BLOCK are kept in a treap keyed by
+ * block size, with the node stored in the payload of the free block
+ * itself.  The rotations are adapted from the splay tree in stree.c.
+ * Blocks of equal size hang off the tree node in a list through
+ * prev/next, so only the first block of each size is in the tree; it
+ * is the one with a null prev link.
+ */
+typedef struct tnode {
+    struct tnode *prev, *next;
+    struct tnode *left, *right, *parent;
+} tnode;
+
+static tnode *large_root;
+
+/*
+ * Free 16-byte mini blocks have no room for a footer or two full links.
+ * They sit on a doubly linked list through their only payload word,
+ * which holds the next and prev links as 32-bit offsets from heap_lo in
+ * ALIGNMENT units, so one is unlinked without a walk.  A mini block too
+ * high in the heap for an offset is left off the list until it is
+ * coalesced.  The block after a mini block has PREV_MINI set in its
+ * header so it can find the start of the block in front without a
+ * footer.
+ */
+static size_t *mini_head;
+
+/*
+ * Objects of up to RUN_MAX bytes are not given a block of their own.
+ * They are carved from runs: page-aligned allocated blocks of RUN_SIZE
+ * bytes, each serving a single size class with no header per object.
+ * A run starts with a struct run whose free_map has a bit set for every
+ * free slot, so a slot is found with a bit scan.  run_map has a bit for
+ * every heap page that holds a run, which is how free tells an object in
+ * a run from a block.  Runs with a free slot are kept in a list per class
+ * and a run whose last object is freed goes back to the heap as a block.
+ *
+ * A page per class is a lot for a program with only a few small objects,
+ * so a class gets its first run only once RUN_MIN_LIVE blocks of the size
+ * its objects take as blocks are live, as counted in small_live by block
+ * size.  Until then, and again once its last run is freed, its objects
+ * are given ordinary blocks.
+ */
+enum {
+    RUN_LOG2     = 12,
+    RUN_SIZE     = 1 << RUN_LOG2,
+    RUN_MAX      = 256,
+    RUN_CLASSES  = RUN_MAX >> 4,
+    RUN_HDR      = 64,
+    RUN_MAP_MIN  = 1 << 12,     /* pages the static run_map covers */
+    RUN_MIN_LIVE = 8,
+    SMALL_SIZES  = ( RUN_MAX >> 4 ) + 2
+};
+
+typedef struct run {
+    struct run *prev, *next;
+    uint32_t size;
+    uint16_t nslots, nfree;
+    uint64_t free_map[4];
+} run;
+
+static run *run_head[RUN_CLASSES];
+static size_t run_count[RUN_CLASSES];
+static size_t small_live[SMALL_SIZES];
+
+static uint64_t *run_map;
+static size_t run_map_pages;
+static uint64_t run_map_min[RUN_MAP_MIN / 64];
+static char *heap_lo;
+
+/*
+ * Freed blocks of a hot size from QUICK_MIN to QUICK_MAX bytes are not
+ * coalesced right away.  They stay marked allocated on a LIFO quick
+ * list for their exact size, linked through the first payload word,
+ * and malloc takes them straight back.  A list that grows past
+ * QUICK_LIMIT blocks is freed for real, and so are all of them when a
+ * fit is missed or a free block of QUICK_CONSOLIDATE bytes forms.  Each
+ * also keeps a footer, so when the top block is freed the list of the
+ * block right below it, which would hold the top back, can be found and
+ * freed without flushing the others.
+ *
+ * Which sizes are hot is learned from quick_hist, a count of mallocs
+ * per size that is halved every QUICK_EPOCH of them.  At that point a
+ * size is hot if it took at least 1/QUICK_HOT of the counted mallocs,
+ * so at most QUICK_HOT sizes are.  A size that cools off has its list
+ * freed, and blocks of cold sizes are freed as usual, so the many sizes
+ * of a spread-out workload do not each hold on to a list of blocks.
+ */
+enum {
+    QUICK_MIN         = RUN_MAX + 16,
+    QUICK_MAX         = LARGE_BLOCK,
+    QUICK_CLASSES     = ( QUICK_MAX - QUICK_MIN ) / 16 + 1,
+    QUICK_LIMIT       = 32,
+    QUICK_CONSOLIDATE = 1 << 16,
+    QUICK_EPOCH       = 1 << 10,
+    QUICK_HOT         = 16
+};
+
+static size_t *quick_head[QUICK_CLASSES];
+static size_t quick_len[QUICK_CLASSES];
+static size_t quick_count;
+static size_t quick_hits, quick_lookups;
+static uint32_t quick_hist[QUICK_CLASSES];
+static bool quick_hot[QUICK_CLASSES];
+static size_t quick_seen;
+
+/*
+ * Operation counts for mm_stats.  Splits, coalesces, heap extensions
+ * and realloc copies are counted here directly, under heap_lock.
+ * Mallocs and frees are counted in ops_global, or with MM_THREADS in
+ * each thread's tcache, which is folded into ops_global when it exits.
+ */
+typedef struct op_counts {
+    size_t mallocs[MM_STATS_CLASSES];
+    size_t frees[MM_STATS_CLASSES];
+} op_counts;
+
+static op_counts ops_global;
+static size_t stat_splits, stat_coalesces[4], stat_extends;
+static size_t stat_realloc_copied, stat_realloc_saved;
+
+/*
+ * Realloc growth prediction.  A heap block that realloc grows is noted
+ * in grow_log, a direct-mapped table keyed by address, along with the
+ * size asked for.  When a noted block grows again it is taken to keep
+ * growing, and gets half as much again as it asked for, so the next
+ * few growths fit in place without a copy.  The headroom is part of
+ * the block: free takes it back with the rest, and a realloc to less
+ * than the size last asked for trims it off and forgets the block.
+ */
 enum {
-    BSZ_32   ,
-    BSZ_64   ,
-    BSZ_128  ,
-    BSZ_256  ,
-    BSZ_512  ,
-    BSZ_1024 ,
-    BSZ_2048 ,
-    BSZ_4096 ,
-    BSZ_8192 ,
-    BSZ_LEN
+    GROW_LOG2 = 6,
+    GROW_SLOTS = 1 << GROW_LOG2
 };
 
-static size_t * free_head[BSZ_LEN];
+typedef struct grow_note {
+    void *bp;               /* the block, NULL for an empty slot */
+    size_t size;            /* the bytes last asked for */
+} grow_note;
+
+static grow_note grow_log[GROW_SLOTS];
+
+#ifdef MM_THREADS
+/* Bumped by mm_init so thread caches can tell they are stale */
+static size_t heap_gen;
+
+/*
+ * A free that finds heap_lock taken does not wait for it.  The object is
+ * pushed onto remote_frees, a lock-free stack linked through the first
+ * payload word that any thread may push to, and the next thread to take
+ * the lock for a malloc or free detaches the whole stack and frees it
+ * in one batch.
+ */
+static size_t *remote_frees;
+#endif
+
+static void printTree ( tnode *z, int depth );
 
 static size_t total = 0;
 
 /* What is the correct alignment? */
 #define ALIGNMENT 16
 
-static size_t WSIZE = 8;
+/*
+ * Block tags and free list links.  With MM_COMPACT a header or footer
+ * is 32 bits, the size still in bytes with the flags in its low four
+ * bits, and the two links of a free block are 32-bit offsets from
+ * heap_lo, 0 for none.  The heap is then limited to COMPACT_HEAP_MAX
+ * bytes so every block size and offset fits.  An allocated block
+ * spends 4 bytes on its header instead of 8, and a free 16-byte block
+ * has room for both links and a footer, so it goes in the TLSF lists
+ * rather than on the mini list.
+ */
+#ifdef MM_COMPACT
+typedef uint32_t tag_t;
+typedef uint32_t link_t;
+#define COMPACT_HEAP_MAX ((size_t)UINT32_MAX & ~(size_t)0xF)
+#else
+typedef size_t tag_t;
+typedef size_t *link_t;
+#endif
+
+static size_t WSIZE = sizeof(tag_t);
 
 static size_t DSIZE = 16;
 
 static size_t CHUNKSIZE  = (1<<12); 
 
+static size_t CHUNKMAX   = (1<<18);
+
+static size_t BURST_FITS = 8;
+
+static size_t chunk_size;
+static size_t fits_since_grow;
+
+/* Free top blocks larger than this are trimmed */
+static size_t trim_threshold = (1<<20);
+
+/* Requests this large or larger are mapped on their own */
+static size_t huge_threshold = (1<<18);
+
+/* Fits of this many bytes or more are taken from the back of a block */
+static size_t split_threshold = LARGE_BLOCK;
+
+/* A region of an mm_heap, see mm_heap_create */
+typedef struct heap_region {
+    struct heap_region *prev;   /* the region mapped before this one */
+    size_t len;                 /* bytes mapped, this header included */
+} heap_region;
+
+/* Regions dropped by heaps, kept for reuse and linked through prev */
+static heap_region *region_cache;
+static size_t region_cache_bytes;
+
+static size_t MIN(size_t x, size_t y) {
+    return x < y ? x : y;
+}
+
 static size_t MAX(size_t x, size_t y) {
     if (x > y){
         return x;
@@ -93,38 +383,79 @@ static size_t MAX(size_t x, size_t y) {
     }
 }
 
-static size_t PACK(size_t size, size_t alloc){
-    return (size|alloc);
+/*
+ * Header flag bits.  Only free blocks carry a footer, so PREV_ALLOC
+ * tells a block whether the footer in front of it may be read, and
+ * PREV_MINI that the block in front is a footerless mini block.
+ * PREV_BATCH is only set while free_batch runs, on blocks whose
+ * predecessor it is freeing.
+ */
+enum {
+    ALLOC      = 0x1,
+    PREV_ALLOC = 0x2,
+    PREV_MINI  = 0x4,
+    PREV_BATCH = 0x8
+};
+
+static size_t PACK(size_t size, size_t flags){
+    return (size|flags);
 }
 static size_t GET(void* p){
-    return (*(size_t*)(p));
+    return (*(tag_t*)(p));
 }
 static size_t PUT(void* p, size_t val) {
-    return (*(size_t *)(p) = (val));
+    return (*(tag_t *)(p) = (val));
 }
 
 static size_t GET_SIZE(size_t* p) {
-    return (GET(p) & ~0x7);
+    return (GET(p) & ~(size_t)0xF);
 }
 
 static size_t GET_ALLOC(size_t* p){
     return (GET(p) & 0x1);
 }
 
+static size_t GET_PREV_ALLOC(size_t* p){
+    return (GET(p) & PREV_ALLOC) >> 1;
+}
+
 static void* HDRP(void *bp){
     return ((char *)(bp) - WSIZE);
 }
 
 static void* FTRP(void* bp){
-    return ((char *)(bp) + GET_SIZE(HDRP(bp)) - DSIZE);
+    return ((char *)(bp) + GET_SIZE(HDRP(bp)) - 2*WSIZE);
 }
 
 static void* NEXT_BLKP(void* bp){
     return ((char *)(bp) + GET_SIZE(((bp) - WSIZE)));
 }
 
+/* Only valid when the previous block is free */
 static void* PREV_BLKP(void* bp){
-    return ((char *)(bp) - GET_SIZE(((bp) - DSIZE)));
+    if (GET(HDRP(bp)) & PREV_MINI)
+        return ((char *)(bp) - DSIZE);
+    return ((char *)(bp) - GET_SIZE(((bp) - 2*WSIZE)));
+}
+
+/* Whether a block of size bytes is a mini block, footerless when free */
+static bool is_mini(size_t size){
+#ifdef MM_COMPACT
+    return false;
+#else
+    return size == DSIZE;
+#endif
+}
+
+static void SET_PREV_MINI(void* bp, size_t prev_size){
+    if (is_mini(prev_size))
+        PUT(HDRP(bp), GET(HDRP(bp)) | PREV_MINI);
+    else
+        PUT(HDRP(bp), GET(HDRP(bp)) & ~(size_t)PREV_MINI);
+}
+
+static void SET_PREV_ALLOC(void* bp, size_t prev_alloc){
+    PUT(HDRP(bp), (GET(HDRP(bp)) & ~(size_t)PREV_ALLOC) | (prev_alloc<<1));
 }
 
 
@@ -135,324 +466,2063 @@ static size_t align(size_t x)
     return ALIGNMENT * ((x+ALIGNMENT-1)/ALIGNMENT);
 }
 
-static void unlink2 ( size_t * bp, size_t ** head ){
-    if ( bp[0] )
-        ((size_t*)bp[0])[1] = bp[1];
-    if ( bp[1] )
-        ((size_t*)bp[1])[0] = bp[0];
+static void set_bin ( size_t index ){
+    fl_bitmap |= 1ull << ( index / SL_COUNT );
+    sl_bitmap[index / SL_COUNT] |= 1u << ( index % SL_COUNT );
+}
+
+static void clear_bin ( size_t index ){
+    sl_bitmap[index / SL_COUNT] &= ~( 1u << ( index % SL_COUNT ) );
+    if ( !sl_bitmap[index / SL_COUNT] )
+        fl_bitmap &= ~( 1ull << ( index / SL_COUNT ) );
+}
+
+/* The free list neighbours of bp, linked through its first payload bytes */
+static size_t * list_prev ( size_t * bp ){
+#ifdef MM_COMPACT
+    link_t l = ((link_t*)bp)[0];
+    return l ? (size_t*)( heap_lo + l ) : NULL;
+#else
+    return ((link_t*)bp)[0];
+#endif
+}
+
+static size_t * list_next ( size_t * bp ){
+#ifdef MM_COMPACT
+    link_t l = ((link_t*)bp)[1];
+    return l ? (size_t*)( heap_lo + l ) : NULL;
+#else
+    return ((link_t*)bp)[1];
+#endif
+}
+
+static void set_prev ( size_t * bp, size_t * p ){
+#ifdef MM_COMPACT
+    ((link_t*)bp)[0] = p ? (link_t)( (char*)p - heap_lo ) : 0;
+#else
+    ((link_t*)bp)[0] = p;
+#endif
+}
+
+static void set_next ( size_t * bp, size_t * n ){
+#ifdef MM_COMPACT
+    ((link_t*)bp)[1] = n ? (link_t)( (char*)n - heap_lo ) : 0;
+#else
+    ((link_t*)bp)[1] = n;
+#endif
+}
+
+/* The fit index of list index, NULL if it has none */
+static fit_index *fidx_of ( size_t index ){
+    return fidx_on && index >= FIDX_FIRST ? &fidx[index - FIDX_FIRST] : NULL;
+}
+
+/* bp's offset in a fit index, 0 if it lies too high to be indexed */
+static uint32_t fidx_off ( size_t * bp ){
+    size_t off = (size_t)( (char*)bp - heap_lo ) >> ALIGN_LOG2;
+
+    return off <= UINT32_MAX ? (uint32_t)off : 0;
+}
+
+/* The first of the FIDX_SLOTS lanes equal to x, or -1 */
+static int fidx_lane ( const uint32_t *lanes, uint32_t x ){
+    const fidx_vec *v = (const fidx_vec*)lanes;
+
+    for ( int h = 0; h < FIDX_SLOTS / 4; h++ ){
+        fidx_mask hit = v[h] == x;
+        for ( int i = 0; i < 4; i++ )
+            if ( hit[i] )
+                return 4 * h + i;
+    }
+    return -1;
+}
+
+/* The slot holding bp in t, or -1 if bp is not indexed */
+static int fidx_find ( fit_index *t, size_t * bp ){
+    uint32_t off = fidx_off ( bp );
+
+    return off ? fidx_lane ( t->off, off ) : -1;
+}
+
+static void fidx_add ( size_t * bp, size_t index ){
+    fit_index *t = fidx_of ( index );
+    uint32_t off;
+    int i;
+
+    if ( !t )
+        return;
+    off = fidx_off ( bp );
+    if ( off && ( i = fidx_lane ( t->size, 0 ) ) >= 0 ){
+        t->size[i] = GET_SIZE(HDRP(bp));
+        t->off[i] = off;
+    }
+    else
+        fidx_spill[index - FIDX_FIRST]++;
+}
+
+static void fidx_remove ( size_t * bp, size_t index ){
+    fit_index *t = fidx_of ( index );
+    int i;
+
+    if ( !t )
+        return;
+    if ( ( i = fidx_find ( t, bp ) ) >= 0 )
+        t->size[i] = t->off[i] = 0;
+    else
+        fidx_spill[index - FIDX_FIRST]--;
+}
+
+/* The block bp of size bytes has taken old's place in list index */
+static void fidx_move ( size_t * old, size_t * bp, size_t size, size_t index ){
+    fit_index *t = fidx_of ( index );
+    int i;
+
+    if ( !t || ( i = fidx_find ( t, old ) ) < 0 )
+        return;
+    t->size[i] = size;
+    if ( !( t->off[i] = fidx_off ( bp ) ) ){
+        t->size[i] = 0;
+        fidx_spill[index - FIDX_FIRST]++;
+    }
+}
+
+static fidx_vec fidx_min ( fidx_vec a, fidx_vec b ){
+    fidx_vec lt = (fidx_vec)( a < b );
+
+    return ( a & lt ) | ( b & ~lt );
+}
+
+_Static_assert ( FIDX_SLOTS == 8, "fidx_fit reduces over eight lanes" );
+
+/*
+ * The smallest indexed block of list index with at least asize bytes,
+ * or NULL.  Taking asize from every size wraps the slots that are too
+ * small or empty past any block size, so the lane holding the least
+ * difference is the fit.  Its header is prefetched for place.
+ */
+static void *fidx_fit ( size_t index, size_t asize ){
+    fit_index *t = &fidx[index - FIDX_FIRST];
+    const fidx_vec *v = (const fidx_vec*)t->size;
+    fidx_vec m = fidx_min ( v[0] - (uint32_t)asize, v[1] - (uint32_t)asize );
+    char *bp;
+
+    m = fidx_min ( m, __builtin_shuffle ( m, (fidx_mask){ 2, 3, 0, 1 } ) );
+    m = fidx_min ( m, __builtin_shuffle ( m, (fidx_mask){ 1, 0, 3, 2 } ) );
+    if ( m[0] > LARGE_BLOCK )
+        return NULL;
+    bp = heap_lo + ( (size_t)t->off[fidx_lane ( t->size, m[0] + (uint32_t)asize )] << ALIGN_LOG2 );
+    __builtin_prefetch ( HDRP(bp), 1 );
+    return bp;
+}
+
+static void unlink2 ( size_t * bp, size_t index ){
+    size_t *p = list_prev ( bp ), *n = list_next ( bp );
+
+    fidx_remove ( bp, index );
+
+    if ( free_finger[index] == bp )
+        free_finger[index] = n ? n : p;
+    if ( free_rover[index] == bp )
+        free_rover[index] = n;
+    if ( p )
+        set_next ( p, n );
+    if ( n )
+        set_prev ( n, p );
+
+    if ( free_head[index] == bp ){
+        free_head[index] = n;
+        if ( !n )
+            clear_bin ( index );
+    }
+}
+
+/* Links bp into the non-empty list index in address order */
+static void link_sorted ( size_t * bp, size_t index ){
+    size_t *p = free_finger[index] ? free_finger[index] : free_head[index];
+    size_t *n;
+
+    /* Find the neighbours p < bp < n */
+    if ( p < bp )
+        for ( n = list_next ( p ); n && n < bp; p = n, n = list_next ( n ) )
+            ;
+    else
+        for ( n = p, p = list_prev ( p ); p && p > bp; n = p, p = list_prev ( p ) )
+            ;
+
+    set_prev ( bp, p );
+    set_next ( bp, n );
+    if ( p )
+        set_next ( p, bp );
+    else
+        free_head[index] = bp;
+    if ( n )
+        set_prev ( n, bp );
+    free_finger[index] = bp;
+}
+
+static void linkh ( size_t * bp, size_t index ){
+    fidx_add ( bp, index );
+    if ( free_order == MM_ORDER_ADDRESS && free_head[index] ){
+        link_sorted ( bp, index );
+        return;
+    }
+    set_prev ( bp, NULL );
+    set_next ( bp, free_head[index] );
+    if ( free_head[index] )
+        set_prev ( free_head[index], bp );
+    else
+        set_bin ( index );
+    free_head[index] = bp;
+}
+
+static void left_rotate ( tnode *x ){
+    tnode *y = x->right;
+    if ( y ){
+        x->right = y->left;
+        if ( y->left ) y->left->parent = x;
+        y->parent = x->parent;
+    }
+    if ( !x->parent ) large_root = y;
+    else if ( x == x->parent->left ) x->parent->left = y;
+    else x->parent->right = y;
+    if ( y ) y->left = x;
+    x->parent = y;
+}
+
+static void right_rotate ( tnode *x ){
+    tnode *y = x->left;
+    if ( y ){
+        x->left = y->right;
+        if ( y->right ) y->right->parent = x;
+        y->parent = x->parent;
+    }
+    if ( !x->parent ) large_root = y;
+    else if ( x == x->parent->left ) x->parent->left = y;
+    else x->parent->right = y;
+    if ( y ) y->right = x;
+    x->parent = y;
+}
+
+/*
+ * Tree priority of a node.  Hashing the block address gives the tree
+ * the shape of a random binary search tree, so its expected depth is
+ * logarithmic whatever the order of sizes inserted.
+ */
+static uint64_t priority ( tnode *x ){
+    return ( (uint64_t)x >> ALIGN_LOG2 ) * 0x9E3779B97F4A7C15ull;
+}
+
+/* Put v in u's place under u's parent */
+static void tree_replace ( tnode *u, tnode *v ){
+    if ( !u->parent ) large_root = v;
+    else if ( u == u->parent->left ) u->parent->left = v;
+    else u->parent->right = v;
+    if ( v ) v->parent = u->parent;
+}
+
+static void tree_insert ( void *bp, size_t size ){
+    tnode *x = (tnode*)bp, *z = large_root, *p = NULL;
+    size_t zsize = 0;
+
+    while ( z ){
+        p = z;
+        zsize = GET_SIZE(HDRP(z));
+        if ( size == zsize ){
+            /* Same size already in the tree: join its list */
+            x->prev = z;
+            x->next = z->next;
+            if ( z->next )
+                z->next->prev = x;
+            z->next = x;
+            return;
+        }
+        z = size > zsize ? z->right : z->left;
+    }
+
+    x->prev = x->next = NULL;
+    x->left = x->right = NULL;
+    x->parent = p;
+    if ( !p ) large_root = x;
+    else if ( zsize < size ) p->right = x;
+    else p->left = x;
+
+    /* Rotate up to restore the heap order on priorities */
+    while ( x->parent && priority ( x ) > priority ( x->parent ) ){
+        if ( x->parent->left == x ) right_rotate ( x->parent );
+        else left_rotate ( x->parent );
+    }
+}
+
+static void tree_remove ( void *bp ){
+    tnode *z = (tnode*)bp, *y;
+
+    if ( z->prev ){
+        /* Not the tree node, just unlink from the same-size list */
+        z->prev->next = z->next;
+        if ( z->next )
+            z->next->prev = z->prev;
+        return;
+    }
+    if ( z->next ){
+        /* Promote the next block of the same size into the tree */
+        y = z->next;
+        y->prev = NULL;
+        y->left = z->left;
+        y->right = z->right;
+        if ( y->left ) y->left->parent = y;
+        if ( y->right ) y->right->parent = y;
+        tree_replace ( z, y );
+        return;
+    }
+
+    /* Rotate down below the higher priority child until a leaf */
+    while ( z->left || z->right ){
+        if ( !z->right || ( z->left && priority ( z->left ) > priority ( z->right ) ) )
+            right_rotate ( z );
+        else
+            left_rotate ( z );
+    }
+    tree_replace ( z, NULL );
+}
+
+/* Best fit: smallest large block of at least asize bytes */
+static void *tree_find ( size_t asize ){
+    tnode *z = large_root, *best = NULL;
+    size_t zsize;
+
+    while ( z ){
+        zsize = GET_SIZE(HDRP(z));
+        if ( zsize == asize ){
+            best = z;
+            break;
+        }
+        if ( zsize > asize ){
+            best = z;
+            z = z->left;
+        }
+        else
+            z = z->right;
+    }
+    if ( !best )
+        return NULL;
+    /* Prefer a list member, it leaves the tree untouched on removal */
+    return best->next ? best->next : best;
+}
+
+static bool is_large ( size_t bsize ){
+    return bsize > LARGE_BLOCK;
+}
+
+/* bp's mini list offset, 0 for NULL or a block too high to link */
+static uint32_t mini_off ( size_t * bp ){
+    size_t off = (size_t)( (char*)bp - heap_lo ) >> ALIGN_LOG2;
+
+    return bp && off <= UINT32_MAX ? (uint32_t)off : 0;
+}
+
+static size_t * mini_at ( uint32_t off ){
+    return off ? (size_t*)( heap_lo + ( (size_t)off << ALIGN_LOG2 ) ) : NULL;
+}
+
+static size_t * mini_next ( size_t * bp ){
+    return mini_at ( ((uint32_t*)bp)[0] );
+}
+
+static size_t * mini_prev ( size_t * bp ){
+    return mini_at ( ((uint32_t*)bp)[1] );
+}
+
+static void mini_insert ( size_t * bp ){
+    uint32_t off = mini_off ( bp );
+
+    if ( !off )
+        return;
+    ((uint32_t*)bp)[0] = mini_off ( mini_head );
+    ((uint32_t*)bp)[1] = 0;
+    if ( mini_head )
+        ((uint32_t*)mini_head)[1] = off;
+    mini_head = bp;
+}
+
+static void mini_remove ( size_t * bp ){
+    size_t *prev, *next;
+
+    if ( !mini_off ( bp ) )
+        return;
+    prev = mini_prev ( bp );
+    next = mini_next ( bp );
+    if ( prev )
+        ((uint32_t*)prev)[0] = ((uint32_t*)bp)[0];
+    else
+        mini_head = next;
+    if ( next )
+        ((uint32_t*)next)[1] = ((uint32_t*)bp)[1];
+}
+
+static void insert_free ( void *bp, size_t size ){
+    if ( is_mini ( size ) )
+        mini_insert ( bp );
+    else if ( is_large ( size ) )
+        tree_insert ( bp, size );
+    else
+        linkh ( bp, get_free_index ( size ) );
+}
 
-    if ( *head == bp )
-        *head = (size_t*)bp[1];
+static void remove_free ( void *bp, size_t size ){
+    if ( is_mini ( size ) )
+        mini_remove ( bp );
+    else if ( is_large ( size ) )
+        tree_remove ( bp );
+    else
+        unlink2 ( bp, get_free_index ( size ) );
 }
 
-static void linkh ( size_t * bp, size_t ** head ){
-    bp[0] = 0;
-    bp[1] = (size_t)(*head);
-    if ( *head )
-        (*head)[0] = (size_t)bp;
-    *head = bp;
+/*
+ * The free block old of old_size bytes has become the free block bp of
+ * size bytes.  If both live in the same TLSF list, bp simply takes
+ * old's place in it, otherwise old is removed and bp inserted.
+ */
+static void move_free ( void *old, size_t old_size, void *bp, size_t size ){
+    size_t * o = (size_t*)old, * p = (size_t*)bp;
+    size_t index = get_free_index ( size );
+
+    if ( is_large ( old_size ) || is_large ( size ) || is_mini ( size )
+         || get_free_index ( old_size ) != index ){
+        remove_free ( old, old_size );
+        insert_free ( bp, size );
+        return;
+    }
+    fidx_move ( o, p, size, index );
+    if ( o == p )
+        return;
+
+    set_prev ( p, list_prev ( o ) );
+    set_next ( p, list_next ( o ) );
+    if ( list_prev ( p ) )
+        set_next ( list_prev ( p ), p );
+    if ( list_next ( p ) )
+        set_prev ( list_next ( p ), p );
+    if ( free_head[index] == o )
+        free_head[index] = p;
+    if ( free_finger[index] == o )
+        free_finger[index] = p;
+    if ( free_rover[index] == o )
+        free_rover[index] = p;
 }
 
 static void *coalesce(void *bp) 
 {
-    size_t*prev = PREV_BLKP(bp),
+    size_t*prev,
           *next = NEXT_BLKP(bp);
-    size_t prev_alloc = GET_ALLOC(FTRP(prev));
+    size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
     size_t next_alloc = GET_ALLOC(HDRP(next));
     size_t size = GET_SIZE(HDRP(bp)), old_size, nxt_size;
-    size_t * p = (size_t*)bp;
-    size_t old_index, index, nxt_index;
 
     if (prev_alloc && next_alloc) {            /* Case 1 */
-        index = get_free_index(size);
-        p[0] = 0;
-        p[1] = 0;
-        if ( free_head[index] ){
-            p[1] = (size_t)free_head[index];
-            free_head[index][0] = (size_t)p;
-        }
-        free_head[index] = p;
-
+        stat_coalesces[0]++;
+        insert_free ( bp, size );
         return bp;
     }
 
     else if (prev_alloc && !next_alloc) {      /* Case 2  A  A->F F */
-        old_size  = GET_SIZE(HDRP(NEXT_BLKP(bp)));
-        old_index = get_free_index ( old_size );
-
-        size += old_size;
-        PUT(HDRP(bp), PACK(size, 0));
-        PUT(FTRP(bp), PACK(size,0));
-
-        index = get_free_index ( size );
-
-        p[0] = next[0];
-        p[1] = next[1];
-
-        if ( p[0] )
-            ((size_t*)p[0])[1] = (size_t)p;
-        if ( p[1] )
-            ((size_t*)p[1])[0] = (size_t)p;
+        stat_coalesces[1]++;
+        old_size  = GET_SIZE(HDRP(next));
 
-        if ( next == free_head[index] )
-            free_head[index] = p;
+        /* The new footer goes over a mini block's link */
+        if ( is_mini ( old_size ) )
+            remove_free ( next, old_size );
 
-        if ( old_index != index ){
-            unlink2 ( next, free_head + old_index );
-            linkh   ( p   , free_head +     index );
-        } 
+        size += old_size;
+        PUT(HDRP(bp), PACK(size, GET(HDRP(bp)) & (PREV_ALLOC | PREV_MINI)));
+        PUT(FTRP(bp), PACK(size, 0));
+        SET_PREV_MINI(NEXT_BLKP(bp), size);
 
+        if ( is_mini ( old_size ) )
+            insert_free ( bp, size );
+        else
+            move_free ( next, old_size, bp, size );
     }
 
     else if (!prev_alloc && next_alloc) {      /* Case 3  F A->F A */
-        old_size  = GET_SIZE(HDRP(PREV_BLKP(bp)));
-        old_index = get_free_index ( old_size ); 
+        stat_coalesces[2]++;
+        prev      = PREV_BLKP(bp);
+        old_size  = GET_SIZE(HDRP(prev));
 
         size += old_size;
         PUT(FTRP(bp), PACK(size, 0));
-        PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
-        bp = PREV_BLKP(bp);
+        PUT(HDRP(prev), PACK(size, GET(HDRP(prev)) & (PREV_ALLOC | PREV_MINI)));
+        SET_PREV_MINI(next, size);
+        bp = prev;
 
-        index = get_free_index ( size );
-
-        if ( old_index != index ){
-            unlink2 ( bp, free_head + old_index );
-            linkh   ( bp, free_head +     index );
-        }
+        move_free ( bp, old_size, bp, size );
     }
 
     else {                                     /* Case 4 */
-        old_size  = GET_SIZE(HDRP(PREV_BLKP(bp)));
-        nxt_size  = GET_SIZE(FTRP(NEXT_BLKP(bp)));
-        old_index = get_free_index ( old_size );
-        nxt_index = get_free_index ( nxt_size );
+        stat_coalesces[3]++;
+        prev      = PREV_BLKP(bp);
+        old_size  = GET_SIZE(HDRP(prev));
+        nxt_size  = GET_SIZE(HDRP(next));
 
-        size += old_size + nxt_size;
-        PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
-        PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0));
-        bp = PREV_BLKP(bp);
-
-        index = get_free_index ( size );
+        remove_free ( next, nxt_size );
 
-        unlink2 ( next, free_head + nxt_index );
+        size += old_size + nxt_size;
+        PUT(HDRP(prev), PACK(size, GET(HDRP(prev)) & (PREV_ALLOC | PREV_MINI)));
+        PUT(FTRP(prev), PACK(size, 0));
+        SET_PREV_MINI(NEXT_BLKP(prev), size);
+        bp = prev;
 
-        if ( old_index != index ){
-            unlink2 ( bp, free_head + old_index );
-            linkh   ( bp, free_head +     index );
-        }
+        move_free ( bp, old_size, bp, size );
     }
     return bp;
 }
 
-static void *extend_heap(size_t words) 
+/*
+ * Heap bytes from zero_lo up to the footer of the free top block have
+ * not been written since memlib handed them out, so they read as zero.
+ * zero_lo always lies past the top block's free-list links.  Each block
+ * taken for use goes through zero_claim, which records in last_zero
+ * where the known zeros began if the block reaches into them.
+ */
+static char *zero_lo;
+static char *last_zero;
+
+static void zero_claim(char *bp)
 {
-    char *bp;
+    char *end = NEXT_BLKP(bp);
+
+    if (end <= zero_lo)
+        return;
+    last_zero = zero_lo;
+    /* The whole top block was taken, along with its footer */
+    if (GET_SIZE(HDRP(end)) == 0 && !is_mini(end - bp))
+        PUT(end - 2*WSIZE, 0);
+    zero_lo = end + sizeof(tnode);
+}
+
+static void *extend_heap(size_t words) 
+{
+    char *bp, *top;
     size_t size;
+    bool fresh;
   
-    size = (words % 2) ? (words+1) * WSIZE : words * WSIZE; 
+    size = align(words * WSIZE);
+#ifdef MM_COMPACT
+    if (mem_heapsize() + size > COMPACT_HEAP_MAX)
+        return NULL;
+#endif
 
+    fresh = (char *)mem_zero_lo() <= (char *)mem_heap_hi() + 1;
     if ((long)(bp = mem_sbrk(size)) == -1)  
         return NULL;                                   
 
     total += size;
+    stat_extends++;
   
-    PUT(HDRP(bp), PACK(size, 0));         
+    /* The new block starts at the old epilogue, keep its prev flags */
+    PUT(HDRP(bp), PACK(size, GET(HDRP(bp)) & (PREV_ALLOC | PREV_MINI)));         
     PUT(FTRP(bp), PACK(size, 0));        
-    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); 
+    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, ALLOC)); 
+    SET_PREV_MINI(NEXT_BLKP(bp), size);
+
+    top = coalesce ( bp );
+    if (!fresh)
+        zero_lo = (char *)mem_heap_hi() + 1;
+    else if (top != bp && zero_lo <= bp - 2*WSIZE) {
+        /* Clear the old footer and epilogue to join the two zero runs */
+        PUT(bp - 2*WSIZE, 0);
+        PUT(bp - WSIZE, 0);
+    }
+    else
+        zero_lo = (char *)MAX((size_t)bp, (size_t)top + sizeof(tnode));
+    return top;
+}
+
+/* The policy named by MM_POLICY, good fit if it names none */
+static enum mm_policy policy_env ( void ){
+    const char *name = getenv ( "MM_POLICY" );
+
+    for ( int i = 0; name && i < MM_POLICIES; i++ )
+        if ( !strcmp ( name, policy_names[i] ) )
+            return (enum mm_policy)i;
+    return MM_POLICY_GOOD;
+}
+
+/*
+ * Initialize: returns false on error, true on success.
+ */
+bool mm_init(void)
+{
+    memset( free_head, 0, sizeof(free_head) );
+    memset( free_finger, 0, sizeof(free_finger) );
+    memset( free_rover, 0, sizeof(free_rover) );
+    free_order = free_order_next;
+    if ( !fit_policy_set )
+        fit_policy_next = policy_env ();
+    fit_policy = fit_policy_next;
+    fidx_on = free_order == MM_ORDER_LIFO
+        && ( fit_policy == MM_POLICY_GOOD || fit_policy == MM_POLICY_BEST );
+    memset( fidx, 0, sizeof(fidx) );
+    memset( fidx_spill, 0, sizeof(fidx_spill) );
+    memset( sl_bitmap, 0, sizeof(sl_bitmap) );
+    fl_bitmap = 0;
+    large_root = NULL;
+    mini_head = NULL;
+    memset( run_head, 0, sizeof(run_head) );
+    memset( run_count, 0, sizeof(run_count) );
+    memset( small_live, 0, sizeof(small_live) );
+    memset( quick_head, 0, sizeof(quick_head) );
+    memset( quick_len, 0, sizeof(quick_len) );
+    quick_count = quick_hits = quick_lookups = 0;
+    memset( quick_hist, 0, sizeof(quick_hist) );
+    memset( quick_hot, 0, sizeof(quick_hot) );
+    quick_seen = 0;
+    memset( &ops_global, 0, sizeof(ops_global) );
+    memset( stat_coalesces, 0, sizeof(stat_coalesces) );
+    stat_splits = stat_extends = 0;
+    stat_realloc_copied = stat_realloc_saved = 0;
+    memset( grow_log, 0, sizeof(grow_log) );
+#ifdef MM_THREADS
+    __atomic_add_fetch ( &heap_gen, 1, __ATOMIC_RELEASE );
+    remote_frees = NULL;
+#endif
+    chunk_size = CHUNKSIZE;
+    fits_since_grow = 0;
+    memset( run_map_min, 0, sizeof(run_map_min) );
+    run_map = run_map_min;
+    run_map_pages = RUN_MAP_MIN;
+    region_cache = NULL;
+    region_cache_bytes = 0;
+    heap_lo = mem_heap_lo();
+
+    /* Create the initial empty heap */
+    if ((heap_listp = mem_sbrk(2*DSIZE)) == (void *)-1)
+        return false;
+    total += 2*DSIZE;
+    PUT(heap_listp, 0);
+    /* Alignment padding, then a DSIZE prologue with an aligned payload */
+    heap_listp += DSIZE;
+    PUT(HDRP(heap_listp), PACK(DSIZE, PREV_ALLOC | ALLOC)); /* Prologue header */
+    PUT(FTRP(heap_listp), PACK(DSIZE, ALLOC)); /* Prologue footer */
+    PUT(HDRP(NEXT_BLKP(heap_listp)), PACK(0, PREV_ALLOC | ALLOC)); /* Epilogue header */
+    SET_PREV_MINI(NEXT_BLKP(heap_listp), DSIZE);
+
+    /* Extend the empty heap with a free block of CHUNKSIZE bytes */
+    if (extend_heap(CHUNKSIZE/WSIZE) == NULL){
+        mm_checkheap(0);
+        return false;
+    }
+    mm_checkheap(0);
+
+    return true;
+}
+
+/* Index of the most significant set bit, v must be non-zero */
+static size_t msb ( size_t v ){
+    return 63 - __builtin_clzll ( v );
+}
+
+static size_t get_free_index ( size_t bsize ){
+    size_t f;
+    if ( bsize < SMALL_BLOCK )
+        return bsize >> ALIGN_LOG2;
+    f = msb ( bsize );
+    return ( f - FL_SHIFT + 1 ) * SL_COUNT
+         + ( ( bsize >> ( f - SL_LOG2 ) ) - SL_COUNT );
+}
+
+/*
+ * Picks a block of at least asize bytes from the non-empty list index
+ * under the placement policy, or returns NULL if none is that large.
+ * First and next fit take the first block that fits, next fit starting
+ * at the rover and going round the list once.  Best fit takes the
+ * smallest block that fits and good fit the smallest of the first
+ * GOOD_FIT_TRIES blocks.  Both stop early on an exact fit.  A list with
+ * a fit index is searched there instead: all of it when the index is
+ * complete, and good fit also takes a fit from a partial one.
+ */
+static void *list_fit ( size_t index, size_t asize ){
+    size_t *start = free_head[index], *bp, *best = NULL;
+    size_t tries = fit_policy == MM_POLICY_GOOD ? GOOD_FIT_TRIES : SIZE_MAX;
+    size_t bsize, best_size = SIZE_MAX;
+
+    if ( fidx_of ( index ) ){
+        size_t spill = fidx_spill[index - FIDX_FIRST];
+
+        if ( !spill || fit_policy == MM_POLICY_GOOD ){
+            best = fidx_fit ( index, asize );
+            if ( best || !spill )
+                return best;
+        }
+    }
+    if ( fit_policy == MM_POLICY_NEXT && free_rover[index] )
+        start = free_rover[index];
+    bp = start;
+    do {
+        bsize = GET_SIZE(HDRP(bp));
+        if ( bsize >= asize && bsize < best_size ){
+            best = bp;
+            best_size = bsize;
+            if ( bsize == asize || fit_policy == MM_POLICY_FIRST
+                 || fit_policy == MM_POLICY_NEXT )
+                break;
+        }
+        if ( !( bp = list_next ( bp ) ) && fit_policy == MM_POLICY_NEXT )
+            bp = free_head[index];
+    } while ( bp && bp != start && --tries );
+
+    if ( best && fit_policy == MM_POLICY_NEXT )
+        free_rover[index] = best;
+    return best;
+}
+
+/*
+ * Round asize up to the next class boundary so that every block in the
+ * chosen list is large enough, then find the first non-empty list at
+ * or above it with two bit scans.  Before that, asize's own class is
+ * searched so a block of that class is not passed over just because of
+ * the rounding.  Large requests, and small ones no list can serve, take
+ * the best fit from the size tree.
+ */
+static void *find_fit(size_t asize)
+{
+    void *bp;
+    size_t need = asize;
+    size_t index;
+    size_t fl, sl;
+    uint64_t fl_map;
+    uint32_t sl_map;
+
+    if ( is_large ( asize ) )
+        return tree_find ( asize );
+    if ( is_mini ( asize ) && mini_head )
+        return mini_head;
+
+    index = get_free_index ( asize );
+    if ( free_head[index] && ( bp = list_fit ( index, asize ) ) )
+        return bp;
+
+    if ( asize >= SMALL_BLOCK ){
+        asize += ( (size_t)1 << ( msb ( asize ) - SL_LOG2 ) ) - 1;
+        index = get_free_index ( asize );
+    }
+    else
+        index++;
+
+    fl = index / SL_COUNT;
+    sl = index % SL_COUNT;
+    if ( fl >= FL_COUNT )
+        return tree_find ( asize );
+
+    sl_map = sl_bitmap[fl] & ( ~0u << sl );
+    if ( !sl_map ){
+        fl_map = fl_bitmap & ( ~0ull << ( fl + 1 ) );
+        if ( !fl_map )
+            return tree_find ( asize );
+        fl = __builtin_ctzll ( fl_map );
+        sl_map = sl_bitmap[fl];
+    }
+    sl = __builtin_ctz ( sl_map );
+    return list_fit ( fl * SL_COUNT + sl, need );
+}
+ 
+
+static void place(void *bp, size_t asize)
+{
+    size_t csize = GET_SIZE(HDRP(bp));   
+
+    if ((csize - asize) >= DSIZE) { 
+        /* The new tags would overwrite a tree node, or bp's links if a
+           mini block is taken */
+        bool relink = is_large ( csize ) || is_mini ( asize );
+
+        stat_splits++;
+        if ( relink )
+            remove_free ( bp, csize );
+
+        PUT(HDRP(bp), PACK(asize, GET(HDRP(bp)) & (PREV_ALLOC | PREV_MINI)) | ALLOC);
+        void * next = NEXT_BLKP(bp);
+        PUT(HDRP(next), PACK(csize-asize, PREV_ALLOC));
+        PUT(FTRP(next), PACK(csize-asize, 0));
+        SET_PREV_MINI(next, asize);
+        SET_PREV_MINI(NEXT_BLKP(next), csize-asize);
+
+        if ( relink )
+            insert_free ( next, csize-asize );
+        else
+            move_free ( bp, csize, next, csize-asize );
+    }
+    else { 
+        remove_free ( bp, csize );
+
+        PUT(HDRP(bp), GET(HDRP(bp)) | ALLOC);
+        SET_PREV_ALLOC(NEXT_BLKP(bp), 1);
+    }
+    zero_claim(bp);
+}
+
+/*
+ * Places a block of asize bytes in the free block bp, a fit from the
+ * free lists, and returns it.  Requests of split_threshold bytes or
+ * more are split off the back of bp and smaller ones off the front, so
+ * small blocks gather at the low end of each free range and large ones
+ * at the high end, with the remainder left free between them.  The top
+ * block is always split from the front, so the heap can still be grown
+ * and trimmed at its end.
+ */
+static void *place_fit(void *bp, size_t asize)
+{
+    size_t csize = GET_SIZE(HDRP(bp)), rsize = csize - asize;
+    char *ap = (char *)bp + rsize;
+    bool relink;
+
+    if (asize < split_threshold || rsize < DSIZE
+        || GET_SIZE(HDRP(NEXT_BLKP(bp))) == 0) {
+        place(bp, asize);
+        return bp;
+    }
 
-    return coalesce ( bp );
+    /* The new tags would overwrite a tree node, or bp's links if a mini
+       block is left */
+    relink = is_large ( csize ) || is_mini ( rsize );
+    stat_splits++;
+    if ( relink )
+        remove_free ( bp, csize );
+
+    PUT(HDRP(bp), PACK(rsize, GET(HDRP(bp)) & (PREV_ALLOC | PREV_MINI)));
+    PUT(FTRP(bp), PACK(rsize, 0));
+    PUT(HDRP(ap), PACK(asize, is_mini(rsize) ? PREV_MINI : 0) | ALLOC);
+    SET_PREV_ALLOC(NEXT_BLKP(ap), 1);
+    SET_PREV_MINI(NEXT_BLKP(ap), asize);
+
+    if ( relink )
+        insert_free ( bp, rsize );
+    else
+        move_free ( bp, csize, bp, rsize );
+    zero_claim(ap);
+    return ap;
+}
+
+/*
+ * Allocates a block of asize bytes, extending the heap if no free block
+ * fits.
+ */
+static bool is_quick ( size_t asize ){
+    return asize >= QUICK_MIN && asize <= QUICK_MAX;
+}
+
+static void free_block(void *bp);
+
+/* Frees every block on quick list i for real */
+static void quick_flush_class ( size_t i ){
+    size_t *bp;
+
+    while ( ( bp = quick_head[i] ) != NULL ){
+        quick_head[i] = (size_t*)bp[0];
+        quick_len[i]--;
+        quick_count--;
+        free_block ( bp );
+    }
+}
+
+/* Frees all quick list blocks, returns whether there were any */
+static bool quick_flush ( void ){
+    if ( !quick_count )
+        return false;
+    for ( size_t i = 0; i < QUICK_CLASSES; i++ )
+        if ( quick_head[i] )
+            quick_flush_class ( i );
+    return true;
+}
+
+/*
+ * The quick list of the block right below the free block bp, or
+ * QUICK_CLASSES if it does not look quick listed.  That block may be in
+ * use and hold anything where quick_push leaves the footer, so the size
+ * read there must lead back to a matching header.  A stray match only
+ * costs the flush of a list.
+ */
+static size_t quick_below ( void *bp ){
+    size_t size = GET_SIZE((void *)((char *)bp - 2*WSIZE));
+    char *prev = (char *)bp - size;
+    size_t i = ( size - QUICK_MIN ) >> ALIGN_LOG2;
+
+    if ( !is_quick ( size ) || prev <= heap_listp
+         || GET_SIZE(HDRP(prev)) != size || !GET_ALLOC(HDRP(prev))
+         || !quick_head[i] )
+        return QUICK_CLASSES;
+    return i;
+}
+
+/*
+ * Quick lists bp if its size is hot, otherwise frees it.  A block at the
+ * top of the heap, under the epilogue or the free top block, is freed
+ * too, so it cannot hold the top back from being trimmed.
+ */
+static void quick_push ( size_t *bp, size_t asize ){
+    size_t i = ( asize - QUICK_MIN ) >> ALIGN_LOG2;
+    char *next = NEXT_BLKP(bp);
+
+    if ( !quick_hot[i] || !GET_SIZE(HDRP(next))
+         || ( !GET_ALLOC(HDRP(next)) && !GET_SIZE(HDRP(NEXT_BLKP(next))) ) ){
+        free_block ( bp );
+        return;
+    }
+    bp[0] = (size_t)quick_head[i];
+    PUT(FTRP(bp), PACK(asize, ALLOC));
+    quick_head[i] = bp;
+    quick_count++;
+    if ( ++quick_len[i] > QUICK_LIMIT )
+        quick_flush_class ( i );
+}
+
+/* Ends an epoch of quick_hist, promoting and demoting sizes */
+static void quick_rehot ( void ){
+    size_t counted = 0;
+
+    for ( size_t i = 0; i < QUICK_CLASSES; i++ )
+        counted += quick_hist[i];
+    for ( size_t i = 0; i < QUICK_CLASSES; i++ ){
+        bool hot = quick_hist[i] * QUICK_HOT >= counted;
+
+        if ( quick_hot[i] && !hot )
+            quick_flush_class ( i );
+        quick_hot[i] = hot;
+        quick_hist[i] /= 2;
+    }
+    quick_seen = 0;
+}
+
+static void *quick_pop ( size_t asize ){
+    size_t i = ( asize - QUICK_MIN ) >> ALIGN_LOG2;
+    size_t *bp;
+
+    quick_hist[i]++;
+    if ( ++quick_seen == QUICK_EPOCH )
+        quick_rehot ();
+    if ( ( bp = quick_head[i] ) != NULL ){
+        quick_head[i] = (size_t*)bp[0];
+        quick_len[i]--;
+        quick_count--;
+    }
+    return bp;
+}
+
+void mm_quick_stats(size_t *hits, size_t *lookups)
+{
+    *hits = quick_hits;
+    *lookups = quick_lookups;
+}
+
+/* The free block at the top of the heap, if there is one */
+static void *top_free(void)
+{
+    char *top = (char *)mem_heap_hi() + 1;
+    if (GET_PREV_ALLOC(HDRP(top)))
+        return NULL;
+    return PREV_BLKP(top);
+}
+
+/*
+ * Number of bytes to extend the heap by for a block of asize bytes.  A
+ * free top block only needs the shortfall added.  Otherwise the heap
+ * grows by CHUNKSIZE, but when it runs dry again within BURST_FITS fits
+ * of the last growth the chunk doubles, up to CHUNKMAX, so an allocation
+ * burst takes few mem_sbrk calls without leaving a large tail unused.
+ */
+static size_t grow_size(size_t asize)
+{
+    void *top = top_free();
+
+    if (top)
+        return asize - GET_SIZE(HDRP(top));
+    if (fits_since_grow < BURST_FITS)
+        chunk_size = MIN(2 * chunk_size, CHUNKMAX);
+    else
+        chunk_size = CHUNKSIZE;
+    fits_since_grow = 0;
+    return MAX(asize, chunk_size);
+}
+
+static void *alloc_block(size_t asize)
+{
+    size_t extendsize; /* Amount to extend heap if no fit */
+    char *bp;
+
+    /* Search the free list for a fit, again after a quick list flush */
+    if ((bp = find_fit(asize)) != NULL
+        || (quick_flush() && (bp = find_fit(asize)) != NULL)) {
+        fits_since_grow++;
+        return place_fit(bp, asize);
+    }
+
+    /* No fit found. Get more memory and place the block */
+    bp = top_free();
+    if (!bp || GET_SIZE(HDRP(bp)) < asize) {
+        extendsize = grow_size(asize);
+        if ((bp = extend_heap(extendsize/WSIZE)) == NULL)
+            return NULL;
+    }
+    place(bp, asize);
+    return bp;
+}
+
+/*
+ * Gives the free top block bp of size bytes back to memlib, all but
+ * half the trim threshold, so a heap that shrinks and grows again around
+ * the threshold does not trim on every cycle.
+ */
+static void trim_top(void *bp, size_t size)
+{
+    size_t keep = align(trim_threshold / 2);
+    size_t release = size - keep;
+
+    if (mem_sbrk(-(intptr_t)release) == (void *)-1)
+        return;
+    total -= release;
+
+    PUT(HDRP(bp), PACK(keep, GET(HDRP(bp)) & (PREV_ALLOC | PREV_MINI)));
+    PUT(FTRP(bp), PACK(keep, 0));
+    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, ALLOC));
+    move_free ( bp, size, bp, keep );
+}
+
+void mm_set_trim_threshold(size_t bytes)
+{
+    trim_threshold = MAX(bytes, 2*CHUNKSIZE);
+}
+
+void mm_set_split_threshold(size_t bytes)
+{
+    split_threshold = bytes;
+}
+
+size_t mm_split_threshold(void)
+{
+    return split_threshold;
+}
+
+void mm_set_free_order(enum mm_free_order order)
+{
+    free_order_next = order;
+}
+
+void mm_set_policy(enum mm_policy policy)
+{
+    fit_policy_next = policy;
+    fit_policy_set = true;
+}
+
+void mm_clear_policy(void)
+{
+    fit_policy_set = false;
+}
+
+const char *mm_policy_name(enum mm_policy policy)
+{
+    return policy < MM_POLICIES ? policy_names[policy] : "?";
+}
+
+static void free_block(void *bp)
+{
+    size_t size = GET_SIZE(HDRP(bp)), i;
+    PUT(HDRP(bp), PACK(size, GET(HDRP(bp)) & (PREV_ALLOC | PREV_MINI)));
+    PUT(FTRP(bp), PACK(size, 0));
+    SET_PREV_ALLOC(NEXT_BLKP(bp), 0);
+
+    bp = coalesce ( bp );
+    size = GET_SIZE(HDRP(bp));
+    if (size >= QUICK_CONSOLIDATE && quick_flush()) {
+        if ((bp = top_free()) == NULL)
+            return;
+        size = GET_SIZE(HDRP(bp));
+    }
+    /* Quick list blocks right below the top hold it back */
+    while (GET_SIZE(HDRP(NEXT_BLKP(bp))) == 0
+           && (i = quick_below(bp)) < QUICK_CLASSES) {
+        quick_flush_class(i);
+        bp = top_free();
+        size = GET_SIZE(HDRP(bp));
+    }
+    if (size > trim_threshold && GET_SIZE(HDRP(NEXT_BLKP(bp))) == 0)
+        trim_top(bp, size);
+}
+
+static void *aligned_fit(size_t asize, size_t align)
+{
+    /* A plain fit will do if it happens to leave room for the slack */
+    char *bp = find_fit(asize);
+    if (bp && (((size_t)bp + align - 1) & ~(align - 1)) - (size_t)bp + asize
+              > GET_SIZE(HDRP(bp)))
+        bp = find_fit(asize + align - DSIZE);
+    return bp;
+}
+
+/*
+ * Allocates a block of asize bytes whose payload is aligned to align, a
+ * power of two.  The slack in front of it is split off as a free block.
+ * When no free block fits, the heap is extended by just what an aligned
+ * block at its top needs.
+ */
+static void *alloc_aligned(size_t asize, size_t align)
+{
+    char *bp, *top;
+    size_t csize, lead;
+    long need;
+
+    bp = aligned_fit(asize, align);
+    if (bp == NULL && quick_flush())
+        bp = aligned_fit(asize, align);
+    if (bp == NULL) {
+        top = (char *)mem_heap_hi() + 1;
+        bp = GET_PREV_ALLOC(HDRP(top)) ? top : PREV_BLKP(top);
+        need = (long)(((size_t)bp + align - 1) & ~(align - 1))
+             + (long)asize - (long)top;
+        if (need > 0 && (bp = extend_heap(need/WSIZE)) == NULL)
+            return NULL;
+    }
+
+    csize = GET_SIZE(HDRP(bp));
+    lead = (((size_t)bp + align - 1) & ~(align - 1)) - (size_t)bp;
+    if (lead) {
+        remove_free ( bp, csize );
+        PUT(HDRP(bp), PACK(lead, GET(HDRP(bp)) & (PREV_ALLOC | PREV_MINI)));
+        PUT(FTRP(bp), PACK(lead, 0));
+        insert_free ( bp, lead );
+
+        bp += lead;
+        csize -= lead;
+        PUT(HDRP(bp), PACK(csize, is_mini(lead) ? PREV_MINI : 0));
+        PUT(FTRP(bp), PACK(csize, 0));
+        SET_PREV_MINI(NEXT_BLKP(bp), csize);
+        insert_free ( bp, csize );
+    }
+    place(bp, asize);
+    return bp;
+}
+
+static size_t run_class ( size_t size ){
+    return ( size - 1 ) >> ALIGN_LOG2;
+}
+
+static size_t run_slot_size ( size_t class ){
+    return ( class + 1 ) << ALIGN_LOG2;
+}
+
+static size_t run_page ( void *bp ){
+    return (size_t)( (char*)bp - heap_lo ) >> RUN_LOG2;
+}
+
+/*
+ * Threads look up run_map without the heap lock, so it is read and
+ * written atomically, and a new map is published before its size.
+ */
+static bool is_run ( void *bp ){
+    size_t page = run_page ( bp );
+    uint64_t *map;
+
+    if ( page >= __atomic_load_n ( &run_map_pages, __ATOMIC_ACQUIRE ) )
+        return false;
+    map = __atomic_load_n ( &run_map, __ATOMIC_ACQUIRE );
+    return __atomic_load_n ( &map[page / 64], __ATOMIC_RELAXED ) >> ( page % 64 ) & 1;
+}
+
+/*
+ * Sets the run_map bit of r's page, growing the map to cover it first.
+ * The map starts as run_map_min and grows into regions mapped outside
+ * the heap, so it never pins free space below it when the top of the
+ * heap is trimmed.
+ */
+static bool run_map_mark ( run *r ){
+    size_t page = run_page ( r ), bits = 8 * mem_pagesize ( ), pages;
+    uint64_t *map;
+
+    if ( page >= run_map_pages ){
+        pages = ( MAX ( 2 * run_map_pages, page + 1 ) + bits - 1 ) & ~( bits - 1 );
+        map = mem_map ( pages / 8 );
+        if ( !map )
+            return false;
+        memcpy ( map, run_map, run_map_pages / 8 );
+        /* With threads a lookup may still be reading the old map */
+#ifndef MM_THREADS
+        if ( run_map != run_map_min )
+            mem_unmap ( run_map, run_map_pages / 8 );
+#endif
+        __atomic_store_n ( &run_map, map, __ATOMIC_RELEASE );
+        __atomic_store_n ( &run_map_pages, pages, __ATOMIC_RELEASE );
+    }
+    __atomic_fetch_or ( &run_map[page / 64], 1ull << ( page % 64 ), __ATOMIC_RELAXED );
+    return true;
+}
+
+/*
+ * Adds delta to a run_count or small_live counter, never below zero.
+ * They are only written under heap_lock, but malloc reads them without
+ * it to pick a path, so with MM_THREADS the store is atomic.
+ */
+static void run_tally ( size_t *counter, long delta ){
+    size_t n = delta < 0 && !*counter ? 0 : *counter + delta;
+
+#ifdef MM_THREADS
+    __atomic_store_n ( counter, n, __ATOMIC_RELAXED );
+#else
+    *counter = n;
+#endif
+}
+
+/* Counts the block bp in or out of small_live if it is small enough */
+static void small_tally ( void *bp, long delta ){
+    size_t bsize = GET_SIZE(HDRP(bp));
+
+    if ( bsize >> ALIGN_LOG2 < SMALL_SIZES )
+        run_tally ( &small_live[bsize >> ALIGN_LOG2], delta );
+}
+
+/* Whether malloc serves an object of size bytes, at most RUN_MAX, from a run */
+static bool run_ready ( size_t size ){
+    size_t asize = DSIZE * ( ( size + WSIZE + ( DSIZE - 1 ) ) / DSIZE );
+
+    return __atomic_load_n ( &run_count[run_class ( size )], __ATOMIC_RELAXED )
+        || __atomic_load_n ( &small_live[asize >> ALIGN_LOG2], __ATOMIC_RELAXED )
+           >= RUN_MIN_LIVE;
+}
+
+static run *run_new ( size_t class ){
+    run *r = alloc_aligned ( RUN_SIZE, RUN_SIZE );
+    size_t i;
+
+    if ( !r )
+        return NULL;
+    if ( !run_map_mark ( r ) ){
+        free_block ( r );
+        return NULL;
+    }
+    r->size = run_slot_size ( class );
+    r->nslots = r->nfree = ( RUN_SIZE - WSIZE - RUN_HDR ) / r->size;
+    for ( i = 0; i < 4; i++ ){
+        if ( r->nslots >= 64 * ( i + 1 ) )
+            r->free_map[i] = ~0ull;
+        else if ( r->nslots > 64 * i )
+            r->free_map[i] = ~0ull >> ( 64 * ( i + 1 ) - r->nslots );
+        else
+            r->free_map[i] = 0;
+    }
+    r->prev = r->next = NULL;
+    run_head[class] = r;
+    run_tally ( &run_count[class], 1 );
+    return r;
+}
+
+static void *run_alloc ( size_t size ){
+    size_t class = run_class ( size ), slot;
+    run *r = run_head[class];
+    uint64_t *w;
+
+    if ( !r && !( r = run_new ( class ) ) )
+        return NULL;
+
+    for ( w = r->free_map; !*w; w++ )
+        ;
+    slot = ( w - r->free_map ) * 64 + __builtin_ctzll ( *w );
+    *w &= *w - 1;
+
+    /* A full run leaves its class list */
+    if ( !--r->nfree ){
+        run_head[class] = r->next;
+        if ( r->next )
+            r->next->prev = NULL;
+    }
+    return (char*)r + RUN_HDR + slot * r->size;
+}
+
+static void run_free ( void *bp ){
+    run *r = (run*)( (size_t)bp & ~(size_t)( RUN_SIZE - 1 ) );
+    size_t class = run_class ( r->size );
+    size_t slot = (size_t)( (char*)bp - (char*)r - RUN_HDR ) / r->size;
+
+    r->free_map[slot / 64] |= 1ull << ( slot % 64 );
+
+    if ( !r->nfree++ ){
+        /* It was full, back into its class list */
+        r->prev = NULL;
+        r->next = run_head[class];
+        if ( r->next )
+            r->next->prev = r;
+        run_head[class] = r;
+    }
+    else if ( r->nfree == r->nslots ){
+        /* Empty, give the page back so it can coalesce */
+        if ( r->prev )
+            r->prev->next = r->next;
+        else
+            run_head[class] = r->next;
+        if ( r->next )
+            r->next->prev = r->prev;
+        __atomic_fetch_and ( &run_map[run_page ( r ) / 64],
+                             ~( 1ull << ( run_page ( r ) % 64 ) ), __ATOMIC_RELAXED );
+        run_tally ( &run_count[class], -1 );
+        free_block ( r );
+    }
+}
+
+/*
+ * A huge block has a region of its own from mem_map, so it never sits in
+ * the free lists or pins the top of the heap, and free hands its pages
+ * straight back.  The payload starts lead bytes into the region, DSIZE
+ * unless a larger alignment was asked for.  The two words before the
+ * payload hold lead and the size from the payload to the end of the
+ * region.  They are size_t even with MM_COMPACT, as a huge block may
+ * be larger than a 32-bit tag can say.
+ */
+static size_t *huge_tags ( void *bp ){
+    return (size_t*)bp - 2;
+}
+
+static bool is_huge ( void *bp ){
+    /* Its address says so without reading a header others may write */
+    return (char*)bp < heap_lo || (char*)bp > (char*)mem_heap_hi();
+}
+
+/* Region length for a huge payload of size bytes, 0 if too large */
+static size_t huge_len ( size_t lead, size_t size ){
+    size_t page = mem_pagesize();
+
+    if ( size > SIZE_MAX - lead - page )
+        return 0;
+    return ( lead + size + page - 1 ) & ~( page - 1 );
+}
+
+/* Maps a huge block for size bytes aligned to align, a power of two */
+static void *huge_alloc ( size_t size, size_t align ){
+    size_t page = mem_pagesize();
+    size_t lead = MIN(MAX(align, DSIZE), page);
+    size_t len = huge_len ( lead, size );
+    char *region;
+
+    if ( !len )
+        return NULL;
+    if ( align > page )
+        region = mem_map_aligned ( len, align, lead );
+    else
+        region = mem_map ( len );
+    if ( region == NULL )
+        return NULL;
+    huge_tags ( region + lead )[0] = lead;
+    huge_tags ( region + lead )[1] = len - lead;
+    dbg_printf( "malloc: %p  %lu (huge)\n", region + lead, size );
+    return region + lead;
+}
+
+static void huge_free ( void *bp ){
+    size_t lead = huge_tags ( bp )[0];
+
+    dbg_printf( "free  : %p (huge)\n", bp );
+    mem_unmap ( (char*)bp - lead, lead + huge_tags ( bp )[1] );
+}
+
+/*
+ * Resizes huge bp for size bytes, moving it if need be; NULL on failure.
+ * Like any realloc it keeps only the usual alignment.
+ */
+static void *huge_resize ( void *bp, size_t size ){
+    size_t lead = huge_tags ( bp )[0];
+    size_t len = huge_len ( lead, size ), oldlen = lead + huge_tags ( bp )[1];
+    char *region;
+
+    if ( len == oldlen )
+        return bp;
+    if ( !len || ( region = mem_remap ( (char*)bp - lead, oldlen, len ) ) == NULL )
+        return NULL;
+    huge_tags ( region + lead )[1] = len - lead;
+    return region + lead;
+}
+
+void mm_set_huge_threshold(size_t bytes)
+{
+    huge_threshold = MAX(bytes, mem_pagesize());
+}
+
+/* Number of bytes usable in the payload of bp */
+static size_t payload_size ( void *bp ){
+    if ( is_run ( bp ) )
+        return ((run*)( (size_t)bp & ~(size_t)( RUN_SIZE - 1 ) ))->size;
+    if ( is_huge ( bp ) )
+        return huge_tags ( bp )[1];
+    return GET_SIZE(HDRP(bp)) - WSIZE;
+}
+
+/*
+ * Resizes the allocated block bp to asize bytes without moving it.  A
+ * shrink splits off the tail as a free block.  A grow takes in the free
+ * block after bp, and when bp is at the top of the heap the heap is
+ * extended by just the bytes still missing.  Returns false if bp cannot
+ * grow where it is.
+ */
+static bool resize_block(void *bp, size_t asize)
+{
+    size_t csize = GET_SIZE(HDRP(bp)), nsize;
+    void *next = NEXT_BLKP(bp);
+
+    if (asize > csize) {
+        nsize = GET_ALLOC(HDRP(next)) ? 0 : GET_SIZE(HDRP(next));
+        if (csize + nsize < asize) {
+            /* Only the last block in the heap can be made bigger */
+            if (GET_SIZE(HDRP(nsize ? NEXT_BLKP(next) : next)) != 0)
+                return false;
+            if ((next = extend_heap((asize - csize - nsize)/WSIZE)) == NULL)
+                return false;
+            nsize = GET_SIZE(HDRP(next));
+        }
+        remove_free(next, nsize);
+        csize += nsize;
+        PUT(HDRP(bp), PACK(csize, GET(HDRP(bp)) & 0xF));
+        next = NEXT_BLKP(bp);
+        SET_PREV_ALLOC(next, 1);
+        SET_PREV_MINI(next, csize);
+        zero_claim(bp);
+    }
+
+    if (csize - asize >= DSIZE) {
+        stat_splits++;
+        PUT(HDRP(bp), PACK(asize, GET(HDRP(bp)) & 0xF));
+        next = NEXT_BLKP(bp);
+        PUT(HDRP(next), PACK(csize - asize, PREV_ALLOC | ALLOC));
+        SET_PREV_MINI(next, asize);
+        SET_PREV_MINI(NEXT_BLKP(next), csize - asize);
+        free_block(next);
+    }
+    return true;
+}
+
+/* The grow_log slot for bp */
+static grow_note *grow_slot ( void *bp ){
+    return &grow_log[( (size_t)bp >> ALIGN_LOG2 ) * 0x9E3779B97F4A7C15ull
+                     >> ( 64 - GROW_LOG2 )];
+}
+
+/* bp's note in grow_log, NULL if it has none */
+static grow_note *grow_find ( void *bp ){
+    grow_note *g = grow_slot ( bp );
+
+    return g->bp == bp ? g : NULL;
+}
+
+static void grow_add ( void *bp, size_t size ){
+    grow_note *g = grow_slot ( bp );
+
+    g->bp = bp;
+    g->size = size;
+}
+
+/* Drops bp's note, so a block later allocated there starts afresh */
+static void grow_forget ( void *bp ){
+    grow_note *g = grow_slot ( bp );
+
+    if ( g->bp == bp )
+        g->bp = NULL;
+}
+
+/* The block size to give a block that keeps growing, asize plus half */
+static size_t grow_headroom ( size_t asize ){
+    size_t bsize = align ( asize + asize / 2 );
+
+    return bsize < huge_threshold ? bsize : asize;
+}
+
+/*
+ * Resizes the heap block bp in place for a realloc to size bytes, if it
+ * can, growing a noted block into or with headroom and noting any block
+ * that grows.
+ */
+static bool realloc_block(void *bp, size_t size)
+{
+    size_t asize = DSIZE * ((size + WSIZE + (DSIZE-1)) / DSIZE);
+    grow_note *g = grow_find(bp);
+    size_t last = g ? g->size : payload_size(bp);
+
+    if (size <= last) {
+        if (g && size == last)
+            return true;
+        if (g)
+            g->bp = NULL;
+        return resize_block(bp, asize);
+    }
+    if (g && asize <= GET_SIZE(HDRP(bp))) {
+        stat_realloc_saved += last;
+        g->size = size;
+        return true;
+    }
+    if ((g && resize_block(bp, grow_headroom(asize))) || resize_block(bp, asize)) {
+        grow_add(bp, size);
+        return true;
+    }
+    return false;
+}
+
+/*
+ * All heap state is shared, so with MM_THREADS every path into it holds
+ * heap_lock.  Without threads these do nothing.
+ */
+#ifdef MM_THREADS
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void heap_acquire(void)
+{
+    pthread_mutex_lock(&heap_lock);
+}
+
+static void heap_release(void)
+{
+    pthread_mutex_unlock(&heap_lock);
+}
+#else
+static void heap_acquire(void)
+{
+}
+
+static void heap_release(void)
+{
+}
+#endif
+
+static void *heap_malloc(size_t size)
+{
+    size_t asize;      /* Adjusted block size */
+    char *bp;      
+
+
+    /* $end mmmalloc */
+    if (heap_listp == 0){
+        mm_init();
+    }
+    /* $begin mmmalloc */
+    if (size <= RUN_MAX && run_ready(size)) {
+        bp = run_alloc(size);
+        dbg_printf( "malloc: %p  %lu\n",bp,size);
+        mm_checkheap(0);
+        return bp;
+    }
+
+    /* Adjust block size to include the header and alignment reqs. */
+    asize = DSIZE * ((size + (WSIZE) + (DSIZE-1)) / DSIZE);
+
+    bp = NULL;
+    if (is_quick(asize)) {
+        quick_lookups++;
+        if ((bp = quick_pop(asize)) != NULL)
+            quick_hits++;
+    }
+    if (!bp)
+        bp = alloc_block(asize);
+    if (bp)
+        small_tally(bp, 1);
+
+    dbg_printf( "malloc: %p  %lu\n",bp,size);
+
+    #if defined DEBUG && DEBUG > 1
+    printHeap(); printFree(); printf("+++++++++++++++++++++++++++++\n\n");
+    #endif
+
+    mm_checkheap(0);
+    return bp;
+} 
+
+static size_t stats_class ( size_t bytes );
+static void count_free ( size_t class );
+
+static void heap_free(void *ptr)
+{
+    dbg_printf( "free  : %p\n",ptr);
+
+    if (is_run(ptr)) {
+#ifndef MM_THREADS
+        /* With MM_THREADS only flushed thread caches come this way */
+        count_free(stats_class(
+            ((run*)( (size_t)ptr & ~(size_t)( RUN_SIZE - 1 ) ))->size));
+#endif
+        run_free(ptr);
+    }
+    else {
+        count_free(stats_class(GET_SIZE(HDRP(ptr))));
+        small_tally(ptr, -1);
+        grow_forget(ptr);
+        if (is_quick(GET_SIZE(HDRP(ptr))))
+            quick_push(ptr, GET_SIZE(HDRP(ptr)));
+        else
+            free_block(ptr);
+    }
+    #if defined DEBUG && DEBUG > 1
+    printHeap(); printFree(); printf("-----------------------------\n\n");
+    #endif
+
+    mm_checkheap(0);
+}
+
+#ifdef MM_THREADS
+/* Pushes the chain first..last, linked through their first words */
+static void remote_push(size_t *first, size_t *last)
+{
+    size_t *head = __atomic_load_n(&remote_frees, __ATOMIC_RELAXED);
+
+    do
+        last[0] = (size_t)head;
+    while (!__atomic_compare_exchange_n(&remote_frees, &head, first, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Called with heap_lock held */
+static void remote_drain(void)
+{
+    size_t *bp, *next;
+
+    bp = __atomic_exchange_n(&remote_frees, NULL, __ATOMIC_ACQUIRE);
+    for (; bp; bp = next) {
+        next = (size_t*)bp[0];
+        heap_free(bp);
+    }
+}
+
+/*
+ * Every thread caches up to TCACHE_MAX free objects of each run class,
+ * so most small mallocs and frees never take heap_lock.  An empty cache
+ * is refilled and a full one flushed TCACHE_BATCH objects at a time
+ * under the lock, and a thread's cache is drained when it exits.  A
+ * cache filled before the last mm_init is stale and simply dropped.
+ * The cache also holds the thread's malloc and free counts, and is on
+ * tcache_list while the thread lives so mm_stats can add them up.
+ */
+enum {
+    TCACHE_MAX   = 64,
+    TCACHE_BATCH = 32
+};
+
+typedef struct tcache {
+    void *slot[RUN_CLASSES][TCACHE_MAX];
+    uint32_t count[RUN_CLASSES];
+    size_t gen;
+    op_counts ops;
+    struct tcache *next, **pprev;
+} tcache;
+
+static __thread tcache tcache_local;
+
+static tcache *tcache_list;
+static pthread_mutex_t tcache_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+static void tcache_drain(void *arg)
+{
+    tcache *tc = arg;
+
+    heap_acquire();
+    if (tc->gen == heap_gen) {
+        for (size_t i = 0; i < RUN_CLASSES; i++)
+            while (tc->count[i])
+                run_free(tc->slot[i][--tc->count[i]]);
+        /* Its frees are counted in tc, so drain before folding tc in */
+        remote_drain();
+        for (size_t i = 0; i < MM_STATS_CLASSES; i++) {
+            ops_global.mallocs[i] += tc->ops.mallocs[i];
+            ops_global.frees[i] += tc->ops.frees[i];
+        }
+    }
+    pthread_mutex_lock(&tcache_list_lock);
+    if ((*tc->pprev = tc->next) != NULL)
+        tc->next->pprev = tc->pprev;
+    pthread_mutex_unlock(&tcache_list_lock);
+    heap_release();
+}
+
+static void tcache_key_create(void)
+{
+    pthread_key_create(&tcache_key, tcache_drain);
+}
+
+static tcache *tcache_get(void)
+{
+    tcache *tc = &tcache_local;
+
+    if (tc->gen != __atomic_load_n(&heap_gen, __ATOMIC_ACQUIRE)) {
+        if (!tc->gen) {
+            pthread_once(&tcache_once, tcache_key_create);
+            pthread_setspecific(tcache_key, tc);
+            pthread_mutex_lock(&tcache_list_lock);
+            if ((tc->next = tcache_list) != NULL)
+                tc->next->pprev = &tc->next;
+            tc->pprev = &tcache_list;
+            tcache_list = tc;
+            pthread_mutex_unlock(&tcache_list_lock);
+        }
+        memset(tc->count, 0, sizeof(tc->count));
+        memset(&tc->ops, 0, sizeof(tc->ops));
+        tc->gen = heap_gen;
+    }
+    return tc;
+}
+
+static void *tcache_alloc(size_t size)
+{
+    tcache *tc;
+    size_t class = run_class(size);
+    uint32_t n;
+
+    if (__atomic_load_n(&heap_listp, __ATOMIC_ACQUIRE) == 0) {
+        heap_acquire();
+        if (heap_listp == 0)
+            mm_init();
+        heap_release();
+    }
+
+    tc = tcache_get();
+    if (!tc->count[class]) {
+        heap_acquire();
+        remote_drain();
+        for (n = 0; n < TCACHE_BATCH; n++)
+            if ((tc->slot[class][n] = run_alloc(size)) == NULL)
+                break;
+        heap_release();
+        if (!n)
+            return NULL;
+        tc->count[class] = n;
+    }
+    return tc->slot[class][--tc->count[class]];
+}
+
+static void tcache_free(void *ptr, size_t class)
+{
+    tcache *tc = tcache_get();
+
+    if (tc->count[class] == TCACHE_MAX) {
+        /* Flush the coldest objects, from the bottom of the stack */
+        if (pthread_mutex_trylock(&heap_lock) == 0) {
+            for (size_t i = 0; i < TCACHE_BATCH; i++)
+                run_free(tc->slot[class][i]);
+            heap_release();
+        }
+        else {
+            for (size_t i = 0; i + 1 < TCACHE_BATCH; i++)
+                *(void **)tc->slot[class][i] = tc->slot[class][i + 1];
+            remote_push(tc->slot[class][0], tc->slot[class][TCACHE_BATCH - 1]);
+        }
+        memmove(tc->slot[class], tc->slot[class] + TCACHE_BATCH,
+                (TCACHE_MAX - TCACHE_BATCH) * sizeof(void *));
+        tc->count[class] -= TCACHE_BATCH;
+    }
+    tc->slot[class][tc->count[class]++] = ptr;
+}
+#endif
+
+/*
+ * An object is counted in the stats class of its block or run slot
+ * size, which it keeps until it is freed, so its free and its malloc
+ * land in the same class.  Huge objects have the last class.  Each
+ * counter has only one writer, so with MM_THREADS a relaxed store is
+ * enough for mm_stats to read it safely.
+ */
+enum {
+    STATS_HUGE = MM_STATS_CLASSES - 1
+};
+
+static size_t stats_class ( size_t bytes ){
+    return MIN ( msb ( ( bytes - 1 ) | 15 ) - 3, STATS_HUGE - 1 );
+}
+
+/*
+ * Class of the object of size bytes, less than huge_threshold, that
+ * malloc gives.  Rounding up to ALIGNMENT never crosses a power of two
+ * of 16 or more, so the sizes need no aligning first.
+ */
+static size_t heap_class ( size_t size ){
+    return stats_class ( size > RUN_MAX ? size + WSIZE : size );
+}
+
+/* Class of the object of size bytes malloc gives */
+static size_t request_class ( size_t size ){
+    return size >= huge_threshold ? STATS_HUGE : heap_class ( size );
+}
+
+static void count_op ( size_t *counts, size_t class, size_t n ){
+#ifdef MM_THREADS
+    __atomic_store_n ( &counts[class], counts[class] + n, __ATOMIC_RELAXED );
+#else
+    counts[class] += n;
+#endif
+}
+
+static void count_malloc ( size_t class, size_t n ){
+#ifdef MM_THREADS
+    count_op ( tcache_get()->ops.mallocs, class, n );
+#else
+    count_op ( ops_global.mallocs, class, n );
+#endif
+}
+
+static void count_free ( size_t class ){
+#ifdef MM_THREADS
+    count_op ( tcache_get()->ops.frees, class, 1 );
+#else
+    count_op ( ops_global.frees, class, 1 );
+#endif
+}
+
+/*
+ * malloc
+ */
+void* malloc(size_t size)
+{
+    void *bp;
+
+    /* Ignore spurious requests */
+    if (size == 0)
+        return NULL;
+    if (size >= huge_threshold) {
+        if ((bp = huge_alloc(size, ALIGNMENT)) != NULL)
+            count_malloc(STATS_HUGE, 1);
+        return bp;
+    }
+#ifdef MM_THREADS
+    if (size <= RUN_MAX && run_ready(size))
+        bp = tcache_alloc(size);
+    else
+#endif
+    {
+        heap_acquire();
+#ifdef MM_THREADS
+        remote_drain();
+#endif
+        bp = heap_malloc(size);
+        heap_release();
+    }
+    /* A small object not yet given a run is counted by its block size */
+    if (bp)
+        count_malloc(size > RUN_MAX || is_run(bp) ? heap_class(size)
+                     : stats_class(size + WSIZE), 1);
+    return bp;
+}
+
+/*
+ * free
+ */
+void free(void* ptr)
+{
+    if (ptr == NULL)
+        return;
+    if (is_huge(ptr)) {
+        count_free(STATS_HUGE);
+        huge_free(ptr);
+        return;
+    }
+
+#ifdef MM_THREADS
+    if (is_run(ptr)) {
+        size_t size = ((run*)( (size_t)ptr & ~(size_t)( RUN_SIZE - 1 ) ))->size;
+
+        count_free(stats_class(size));
+        tcache_free(ptr, run_class(size));
+        return;
+    }
+    /* Leave the block to the lock holder rather than wait */
+    if (pthread_mutex_trylock(&heap_lock) != 0) {
+        remote_push(ptr, ptr);
+        return;
+    }
+    remote_drain();
+#else
+    heap_acquire();
+#endif
+    heap_free(ptr);
+    heap_release();
 }
 
 /*
- * Initialize: returns false on error, true on success.
+ * free_sized - free ptr, which was asked for with size bytes by malloc,
+ * calloc or realloc.  Most objects of at most RUN_MAX bytes live in a
+ * run, and those skip the header reads.
  */
-bool mm_init(void)
+void free_sized(void* ptr, size_t size)
 {
-    memset( free_head, 0, sizeof(free_head) );
-
-    /* Create the initial empty heap */
-    if ((heap_listp = mem_sbrk(4*WSIZE)) == (void *)-1)
-        return false;
-    total += 4*WSIZE;
-    PUT(heap_listp, 0);
-    /* Alignment padding */
-    PUT(heap_listp + (1*WSIZE), PACK(DSIZE, 1)); /* Prologue header */
-    PUT(heap_listp + (2*WSIZE), PACK(DSIZE, 1)); /* Prologue footer */
-    PUT(heap_listp + (3*WSIZE), PACK(0, 1));     /* Epilogue header */
-    heap_listp += (2*WSIZE);
-
-    /* Extend the empty heap with a free block of CHUNKSIZE bytes */
-    if (extend_heap(CHUNKSIZE/WSIZE) == NULL){
-        mm_checkheap(0);
-        return false;
+    if (ptr == NULL)
+        return;
+    if (size > RUN_MAX || !is_run(ptr)) {
+        free(ptr);
+        return;
     }
-    mm_checkheap(0);
+    count_free(stats_class(align(size)));
 
-    return true;
+#ifdef MM_THREADS
+    tcache_free(ptr, run_class(size));
+#else
+    dbg_printf( "free  : %p  %lu\n", ptr, size );
+    run_free(ptr);
+    mm_checkheap(0);
+#endif
 }
 
-static unsigned long pof2 (unsigned long v)
+/*
+ * malloc_usable_size - bytes the caller may use at ptr, which can be
+ * more than it asked for
+ */
+size_t malloc_usable_size(void* ptr)
 {
-    v--;
-    v |= v >> 1;
-    v |= v >> 2;
-    v |= v >> 4;
-    v |= v >> 8;
-    v |= v >> 16;
-    v++;
-    return v;
-}
+    size_t size;
 
-static size_t get_free_index ( size_t bsize ){
-    if ( bsize <=   32 ) return BSZ_32;
-    if ( bsize <=   64 ) return BSZ_64;
-    if ( bsize <=  128 ) return BSZ_128;
-    if ( bsize <=  256 ) return BSZ_256;
-    if ( bsize <=  512 ) return BSZ_512;
-    if ( bsize <= 1024 ) return BSZ_1024;
-    if ( bsize <= 2048 ) return BSZ_2048;
-    if ( bsize <= 4096 ) return BSZ_4096;
-    return BSZ_8192;
+    if (ptr == NULL)
+        return 0;
+    if (is_run(ptr) || is_huge(ptr))
+        return payload_size(ptr);
+    heap_acquire();
+    size = payload_size(ptr);
+    heap_release();
+    return size;
 }
 
-static void *find_fit(size_t asize)
-
+/*
+ * malloc_good_size - the usable size malloc gives a request of size
+ * bytes, so callers can round a capacity up to it for free
+ */
+size_t malloc_good_size(size_t size)
 {
-    size_t index = get_free_index (asize);
-#if 0
-    void *bp;
-    for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
-        if (!GET_ALLOC(HDRP(bp)) && (asize <= GET_SIZE(HDRP(bp)))) {
-            return bp;
-        }
-    }
-#else
-    size_t *bp;
-    for ( int i = index; i < BSZ_LEN; ++i ){
-        for (bp = free_head[i]; bp ; bp = (size_t*)bp[1] ){
-            if (asize <= GET_SIZE(HDRP(bp))) 
-                return bp;
-        }
+    size_t asize;
+
+    /* A small object gets either a run slot or a block, so the lesser */
+    if (size <= RUN_MAX) {
+        asize = DSIZE * ((MAX(size, 1) + WSIZE + (DSIZE-1)) / DSIZE);
+        return MIN(run_slot_size(run_class(MAX(size, 1))), asize - WSIZE);
     }
-#endif
-    return NULL; /* No fit */
+    if (size >= huge_threshold)
+        return huge_len(DSIZE, size) ? huge_len(DSIZE, size) - DSIZE : size;
+    /* Rounding up must not carry it over into the huge sizes */
+    asize = DSIZE * ((size + WSIZE + (DSIZE-1)) / DSIZE);
+    return MIN(asize - WSIZE, huge_threshold - 1);
 }
- 
 
-static void place(void *bp, size_t asize)
+/*
+ * Splits the allocated block bp into n blocks of asize bytes, the last
+ * taking any slack, and stores their payloads in out
+ */
+static void carve_block(char *bp, size_t asize, size_t n, void **out)
 {
-    size_t csize = GET_SIZE(HDRP(bp));   
-    size_t * p = (size_t*)bp; 
-
-    size_t index, old_index; 
-
-    if ((csize - asize) >= (2*DSIZE)) { 
-        old_index = get_free_index ( csize );
-
-        PUT(HDRP(bp), PACK(asize, 1));
-        PUT(FTRP(bp), PACK(asize, 1));
-        bp = NEXT_BLKP(bp);
-        PUT(HDRP(bp), PACK(csize-asize, 0));
-        PUT(FTRP(bp), PACK(csize-asize, 0));
-
-        index = get_free_index ( csize-asize );
-        size_t * next = (size_t*)bp;
-        next[0] = p[0];
-        next[1] = p[1];
-        if ( p[0] )
-            ((size_t*)p[0])[1] = (size_t)next;
-        if ( p[1] )
-            ((size_t*)p[1])[0] = (size_t)next;
-
-        if ( p == free_head[old_index] )
-            free_head[old_index] = next;
-
-        if ( old_index != index ){
-            unlink2 ( next, free_head + old_index );
-            linkh   ( next, free_head +     index );
-        }
-    }
-    else { 
-        index = get_free_index ( csize );
-        if ( p[0] )
-            ((size_t*)p[0])[1] = p[1];
-        if ( p[1] )
-            ((size_t*)p[1])[0] = p[0];
-        if ( p == free_head[index] )
-            free_head[index] = (size_t*)p[1];
-
-        PUT(HDRP(bp), PACK(csize, 1));
-        PUT(FTRP(bp), PACK(csize, 1));
+    size_t total = GET_SIZE(HDRP(bp)), size = 0;
+    size_t flags = GET(HDRP(bp)) & (PREV_ALLOC | PREV_MINI);
+
+    for (size_t i = 0; i < n; i++) {
+        size = i + 1 < n ? asize : total - i * asize;
+        PUT(HDRP(bp), PACK(size, flags | ALLOC));
+        out[i] = bp;
+        flags = PREV_ALLOC;
+        bp += size;
     }
+    SET_PREV_MINI(bp, size);
 }
+
 /*
- * malloc
+ * malloc_batch - allocate n objects of size bytes each into out and
+ * return how many it got, fewer than n only if memory ran out.  Small
+ * objects come from runs under one lock.  Heap-sized ones are carved
+ * from a single block found or grown for all n at once.
  */
-void* malloc(size_t size)
+size_t malloc_batch(size_t size, size_t n, void** out)
 {
-    size_t asize;      /* Adjusted block size */
-    size_t extendsize; /* Amount to extend heap if no fit */
-    char *bp;      
+    size_t asize, i = 0;
+    char *bp;
 
+    if (size == 0 || n == 0)
+        return 0;
+    if (size >= huge_threshold) {
+        for (; i < n && (out[i] = huge_alloc(size, ALIGNMENT)) != NULL; i++)
+            ;
+        count_malloc(STATS_HUGE, i);
+        return i;
+    }
 
-    /* $end mmmalloc */
-    if (heap_listp == 0){
+    asize = DSIZE * ((size + WSIZE + (DSIZE-1)) / DSIZE);
+    heap_acquire();
+#ifdef MM_THREADS
+    remote_drain();
+#endif
+    if (heap_listp == 0)
         mm_init();
+    if (size <= RUN_MAX) {
+        for (; i < n && (out[i] = run_alloc(size)) != NULL; i++)
+            ;
     }
-    /* $begin mmmalloc */
-    /* Ignore spurious requests */
-    if (size == 0)
-        return NULL;
-
-    /* Adjust block size to include overhead and alignment reqs. */
-    if (size <= DSIZE)                                       
-        asize = 2*DSIZE;                       
-    else
-        asize = DSIZE * ((size + (DSIZE) + (DSIZE-1)) / DSIZE);
-
-    /* Search the free list for a fit */
-    if ((bp = find_fit(asize)) != NULL) {  
-        place(bp, asize);                 
-        dbg_printf( "malloc: %p  %lu\n",bp,size);
-        #if defined DEBUG && DEBUG > 1
-        printHeap(); printFree(); printf("+++++++++++++++++++++++++++++\n\n");
-        #endif
-        return bp;
+    else if (n <= SIZE_MAX / asize && (bp = alloc_block(n * asize)) != NULL) {
+        carve_block(bp, asize, n, out);
+        i = n;
     }
-
-    /* No fit found. Get more memory and place the block */
-    extendsize = MAX(asize,CHUNKSIZE);              
-    if ((bp = extend_heap(extendsize/WSIZE)) == NULL)  
-        return NULL;                                
-    place(bp, asize);                                
-
-    dbg_printf( "malloc: %p  %lu\n",bp,size);
-
-    #if defined DEBUG && DEBUG > 1
-    printHeap(); printFree(); printf("+++++++++++++++++++++++++++++\n\n");
-    #endif
-
+    else {
+        for (; i < n && (out[i] = alloc_block(asize)) != NULL; i++)
+            ;
+    }
+    dbg_printf( "malloc_batch: %lu x %lu\n", i, size );
     mm_checkheap(0);
-    return bp;
-} 
+    heap_release();
+    count_malloc(request_class(size), i);
+    return i;
+}
 
 /*
- * free
+ * free_batch - free the n objects in ptrs, reordering the array.  Run
+ * and huge objects are freed as they come.  Each heap block in the batch
+ * marks the block after it PREV_BATCH, so a stretch of neighbours can be
+ * found from its first block and joined into one block, which is then
+ * freed and coalesced once rather than once per pointer.
  */
-void free(void* ptr)
+void free_batch(void** ptrs, size_t n)
 {
+    size_t i, m = 0, k = 0;
+    char *bp, *end;
 
-    dbg_printf( "free  : %p\n",ptr);
-    size_t size = GET_SIZE(HDRP(ptr));
-    PUT(HDRP(ptr), PACK(size, 0));
-    PUT(FTRP(ptr), PACK(size, 0));
+    heap_acquire();
+#ifdef MM_THREADS
+    remote_drain();
+#endif
+    for (i = 0; i < n; i++) {
+        if ((bp = ptrs[i]) == NULL)
+            continue;
+        if (is_run(bp)) {
+            count_free(stats_class(payload_size(bp)));
+            run_free(bp);
+        }
+        else if (is_huge(bp)) {
+            count_free(STATS_HUGE);
+            huge_free(bp);
+        }
+        else {
+            count_free(stats_class(GET_SIZE(HDRP(bp))));
+            small_tally(bp, -1);
+            grow_forget(bp);
+            ptrs[m++] = bp;
+            end = NEXT_BLKP(bp);
+            PUT(HDRP(end), GET(HDRP(end)) | PREV_BATCH);
+        }
+    }
 
-    coalesce ( ptr );
-    #if defined DEBUG && DEBUG > 1
-    printHeap(); printFree(); printf("-----------------------------\n\n");
-    #endif
+    /* Join each stretch into its first block before freeing any */
+    for (i = 0; i < m; i++) {
+        bp = ptrs[i];
+        if (GET(HDRP(bp)) & PREV_BATCH)
+            continue;
+        end = NEXT_BLKP(bp);
+        while (GET_SIZE(HDRP(end)) && (GET(HDRP(NEXT_BLKP(end))) & PREV_BATCH))
+            end = NEXT_BLKP(end);
+        PUT(HDRP(end), GET(HDRP(end)) & ~(size_t)PREV_BATCH);
+        PUT(HDRP(bp), PACK(end - bp, GET(HDRP(bp)) & 0x7));
+        SET_PREV_MINI(end, end - bp);
+        ptrs[k++] = bp;
+    }
 
+    for (i = 0; i < k; i++) {
+        bp = ptrs[i];
+        if (is_quick(GET_SIZE(HDRP(bp))))
+            quick_push((size_t*)bp, GET_SIZE(HDRP(bp)));
+        else
+            free_block(bp);
+    }
+    dbg_printf( "free_batch: %lu\n", n );
     mm_checkheap(0);
+    heap_release();
 }
 
 /*
@@ -460,8 +2530,10 @@ void free(void* ptr)
  */
 void* realloc(void* oldptr, size_t size)
 {
-    size_t oldsize;
+    size_t oldsize, live = SIZE_MAX, newsize = size;
     void *newptr;
+    grow_note *g;
+    bool resized, grows;
 
     /* If size == 0 then this is just free, and we return NULL. */
     if(size == 0) {
@@ -474,17 +2546,73 @@ void* realloc(void* oldptr, size_t size)
         return malloc(size);
     }
 
-    newptr = malloc(size);
+    /* Resize in place when the object can stay where it is */
+    if(is_run(oldptr)) {
+        oldsize = payload_size(oldptr);
+        if(size <= RUN_MAX && run_class(size) == run_class(oldsize))
+            return oldptr;
+    }
+    else if(is_huge(oldptr)) {
+        oldsize = payload_size(oldptr);
+        if(size >= huge_threshold)
+            return huge_resize(oldptr, size);
+    }
+    else {
+        /*
+         * A block that turns huge moves out of the heap, and one that
+         * turns small moves too, so malloc picks a run or a block for it
+         */
+        heap_acquire();
+        oldsize = payload_size(oldptr);
+        small_tally(oldptr, -1);
+        resized = size > RUN_MAX && size < huge_threshold &&
+            realloc_block(oldptr, size);
+        small_tally(oldptr, 1);
+        /*
+         * A noted block that has to move takes its headroom along, and
+         * only its live bytes are copied
+         */
+        if(!resized && (g = grow_find(oldptr)) != NULL) {
+            if(size > g->size && size > RUN_MAX && size < huge_threshold)
+                newsize = MAX(size, grow_headroom(
+                    DSIZE * ((size + WSIZE + (DSIZE-1)) / DSIZE)) - WSIZE);
+            live = g->size;
+            g->bp = NULL;
+        }
+        if(resized) {
+            /* Count it as a free and a malloc if it changed class */
+            size_t oldclass = stats_class(oldsize + WSIZE);
+            size_t newclass = stats_class(GET_SIZE(HDRP(oldptr)));
+
+            if(oldclass != newclass) {
+                count_free(oldclass);
+                count_malloc(newclass, 1);
+            }
+            mm_checkheap(0);
+        }
+        heap_release();
+        if(resized)
+            return oldptr;
+    }
+
+    newptr = malloc(newsize);
+    if(!newptr && newsize != size)
+        newptr = malloc(size);
 
     /* If realloc() fails the original block is left untouched  */
     if(!newptr) {
         return 0;
     }
 
-    /* Copy the old data. */
-    oldsize = GET_SIZE(HDRP(oldptr));
-    if(size < oldsize) oldsize = size;
+    /* Copy the old data, and note a heap block that grew */
+    grows = size > oldsize;
+    oldsize = MIN(oldsize, MIN(live, size));
     memcpy(newptr, oldptr, oldsize);
+    heap_acquire();
+    stat_realloc_copied += oldsize;
+    if(grows && !is_run(newptr) && !is_huge(newptr))
+        grow_add(newptr, size);
+    heap_release();
 
     /* Free the old block. */
     free(oldptr);
@@ -492,19 +2620,330 @@ void* realloc(void* oldptr, size_t size)
     return newptr;
 }
 /*
- * calloc
- * This function is not tested by mdriver, and has been implemented for you.
+ * memalign - allocate size bytes aligned to alignment, a power of two.
+ * Blocks from the heap have the slack in front of them split off as a
+ * free block.  Huge sizes and alignments get a region of their own.
+ */
+void* memalign(size_t alignment, size_t size)
+{
+    size_t asize;
+    void *bp;
+
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (alignment <= ALIGNMENT)
+        return malloc(size);
+    if (size == 0)
+        return NULL;
+    if (size >= huge_threshold || alignment >= huge_threshold) {
+        if ((bp = huge_alloc(size, alignment)) != NULL)
+            count_malloc(STATS_HUGE, 1);
+        return bp;
+    }
+
+    asize = DSIZE * ((size + WSIZE + (DSIZE-1)) / DSIZE);
+    heap_acquire();
+#ifdef MM_THREADS
+    remote_drain();
+#endif
+    if (heap_listp == 0)
+        mm_init();
+    bp = alloc_aligned(asize, alignment);
+    if (bp)
+        count_malloc(stats_class(GET_SIZE(HDRP(bp))), 1);
+    dbg_printf( "memalign: %p  %lu %lu\n", bp, alignment, size );
+    mm_checkheap(0);
+    heap_release();
+    return bp;
+}
+
+/*
+ * aligned_alloc - C11 spelling of memalign
+ */
+void* aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+/*
+ * posix_memalign - memalign that returns an error number instead, and
+ * also wants alignment to be a multiple of sizeof(void *)
+ */
+int posix_memalign(void** memptr, size_t alignment, size_t size)
+{
+    void *bp;
+
+    if (alignment % sizeof(void*) != 0 || alignment == 0 ||
+        (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+    if ((bp = memalign(alignment, size)) == NULL && size != 0)
+        return ENOMEM;
+    *memptr = bp;
+    return 0;
+}
+
+/*
+ * calloc - fails with ENOMEM if nmemb * size overflows.  Huge requests
+ * are fresh mappings and heap blocks carved from the top may reach into
+ * bytes that were never written, so only the rest is cleared.
  */
 void* calloc(size_t nmemb, size_t size)
 {
-    void* ptr;
-    size *= nmemb;
-    ptr = malloc(size);
+    char *ptr, *zero;
+
+    if (__builtin_mul_overflow(nmemb, size, &size)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (size == 0)
+        return NULL;
+    if (size >= huge_threshold) {
+        if ((ptr = huge_alloc(size, ALIGNMENT)) != NULL)
+            count_malloc(STATS_HUGE, 1);
+        return ptr;
+    }
+    if (size <= RUN_MAX) {
+        if ((ptr = malloc(size)) != NULL)
+            memset(ptr, 0, size);
+        return ptr;
+    }
+
+    heap_acquire();
+#ifdef MM_THREADS
+    remote_drain();
+#endif
+    last_zero = NULL;
+    ptr = heap_malloc(size);
+    zero = last_zero;
+    heap_release();
     if (ptr) {
-        memset(ptr, 0, size);
+        count_malloc(request_class(size), 1);
+        memset(ptr, 0, zero ? MIN(size, zero - ptr) : size);
     }
     return ptr;
 }
+/*
+ * First-class heaps.  An mm_heap carves objects bump-pointer fashion
+ * from regions it maps with mem_map.  mm_heap_free puts an object of
+ * at most HEAP_BIN_MAX bytes on the heap's own LIFO bin for its aligned
+ * size, linked through its first word, and mm_heap_malloc takes it from
+ * there before carving; larger objects come back only in bulk.
+ * mm_heap_release rolls the heap back to a mark and mm_heap_destroy
+ * unmaps it whole, each in time linear in the regions dropped.  Release
+ * empties the bins, as objects on them may lie past the mark.  The
+ * regions form a stack, newest first, and each is at least twice the
+ * one before up to HEAP_REGION_MAX.  The mm_heap itself lives at the
+ * start of its first region.  Regions dropped by either call are kept,
+ * up to HEAP_CACHE_BYTES of them, for the next heap to grow into
+ * without mapping and faulting in fresh pages.  Its objects must not be
+ * passed to free or realloc, and a heap is not locked, so only one
+ * thread may use it at a time.
+ */
+#define HEAP_REGION_MIN (1<<16)
+#define HEAP_REGION_MAX (1<<22)
+#define HEAP_CACHE_BYTES (1<<23)
+#define HEAP_BIN_MAX 4096
+#define HEAP_BINS (HEAP_BIN_MAX / ALIGNMENT)
+
+struct mm_heap {
+    heap_region *top;           /* the newest region */
+    char *brk, *end;            /* its unused bytes */
+    size_t grow;                /* length of the next region */
+    void *bins[HEAP_BINS];      /* freed objects by size, see mm_heap_free */
+};
+
+/* Takes a cached region of at least len bytes, NULL if there is none */
+static heap_region *region_reuse(size_t len)
+{
+    heap_region **link, *r;
+
+    heap_acquire();
+    for (link = &region_cache; (r = *link) != NULL; link = &r->prev)
+        if (r->len >= len) {
+            *link = r->prev;
+            region_cache_bytes -= r->len;
+            break;
+        }
+    heap_release();
+    return r;
+}
+
+static void region_drop(heap_region *r)
+{
+    heap_acquire();
+    if (region_cache_bytes + r->len <= HEAP_CACHE_BYTES) {
+        r->prev = region_cache;
+        region_cache = r;
+        region_cache_bytes += r->len;
+        r = NULL;
+    }
+    heap_release();
+    if (r)
+        mem_unmap(r, r->len);
+}
+
+/* Maps a region for at least size more bytes and makes it the top */
+static bool heap_region_new(mm_heap *heap, size_t size)
+{
+    size_t page = mem_pagesize(), len;
+    heap_region *r;
+
+    if (size > SIZE_MAX - page - sizeof(heap_region))
+        return false;
+    len = (MAX(heap->grow, sizeof(heap_region) + size) + page - 1) & ~(page - 1);
+    if ((r = region_reuse(len)) != NULL)
+        len = r->len;
+    else if ((r = mem_map(len)) == NULL)
+        return false;
+    r->prev = heap->top;
+    r->len = len;
+    heap->top = r;
+    heap->brk = (char *)r + align(sizeof(heap_region));
+    heap->end = (char *)r + len;
+    heap->grow = MIN(2 * heap->grow, HEAP_REGION_MAX);
+    return true;
+}
+
+mm_heap *mm_heap_create(void)
+{
+    mm_heap boot = { NULL, NULL, NULL, HEAP_REGION_MIN, { NULL } }, *heap;
+
+    if (!heap_region_new(&boot, align(sizeof(mm_heap))))
+        return NULL;
+    heap = (mm_heap *)boot.brk;
+    *heap = boot;
+    heap->brk += align(sizeof(mm_heap));
+    dbg_printf( "heap_create: %p\n", heap );
+    return heap;
+}
+
+void *mm_heap_malloc(mm_heap *heap, size_t size)
+{
+    char *bp;
+
+    if (size == 0 || size > SIZE_MAX - ALIGNMENT)
+        return NULL;
+    size = align(size);
+    if (size <= HEAP_BIN_MAX && (bp = heap->bins[size / ALIGNMENT - 1]) != NULL) {
+        heap->bins[size / ALIGNMENT - 1] = *(void **)bp;
+        return bp;
+    }
+    if ((size_t)(heap->end - heap->brk) < size && !heap_region_new(heap, size))
+        return NULL;
+    bp = heap->brk;
+    heap->brk += size;
+    return bp;
+}
+
+void mm_heap_free(mm_heap *heap, void *ptr, size_t size)
+{
+    size = align(size);
+    if (ptr == NULL || size > HEAP_BIN_MAX)
+        return;
+    *(void **)ptr = heap->bins[size / ALIGNMENT - 1];
+    heap->bins[size / ALIGNMENT - 1] = ptr;
+}
+
+void *mm_heap_mark(mm_heap *heap)
+{
+    return heap->brk;
+}
+
+void mm_heap_release(mm_heap *heap, void *mark)
+{
+    heap_region *r;
+
+    /* Unmap the regions mapped since the mark was taken */
+    while ((char *)mark < (char *)heap->top + align(sizeof(heap_region))
+           || (char *)mark > heap->end) {
+        r = heap->top;
+        heap->top = r->prev;
+        heap->end = (char *)heap->top + heap->top->len;
+        region_drop(r);
+    }
+    heap->brk = mark;
+    heap->grow = MIN(2 * heap->top->len, HEAP_REGION_MAX);
+    memset(heap->bins, 0, sizeof(heap->bins));
+}
+
+void mm_heap_destroy(mm_heap *heap)
+{
+    heap_region *r = heap->top, *prev;
+
+    dbg_printf( "heap_destroy: %p\n", heap );
+    /* The last region unmapped holds heap itself */
+    for (; r != NULL; r = prev) {
+        prev = r->prev;
+        region_drop(r);
+    }
+}
+
+/* Counts the free blocks in the subtree z and the bytes they hold */
+static void tree_stats ( tnode *z, size_t *blocks, size_t *bytes ){
+    for ( ; z; z = z->right ){
+        for ( tnode *t = z; t; t = t->next ){
+            (*blocks)++;
+            *bytes += GET_SIZE(HDRP(t));
+        }
+        tree_stats ( z->left, blocks, bytes );
+    }
+}
+
+/*
+ * mm_stats - fills in stats.  The free lists are walked, so this takes
+ * time in proportion to the number of free blocks.
+ */
+void mm_stats(struct mm_stats *stats)
+{
+    size_t i, *bp;
+
+    memset(stats, 0, sizeof(*stats));
+    heap_acquire();
+#ifdef MM_THREADS
+    remote_drain();
+#endif
+    stats->heap_bytes = mem_heapsize();
+    stats->mapped_bytes = mem_mapsize();
+    if (heap_listp != 0) {
+        for (i = 0; i < BIN_LEN; i++)
+            for (bp = free_head[i]; bp; bp = list_next(bp)) {
+                stats->bin_blocks[i]++;
+                stats->free_bytes += GET_SIZE(HDRP(bp));
+            }
+        tree_stats(large_root, &stats->tree_blocks, &stats->free_bytes);
+        for (bp = mini_head; bp; bp = mini_next(bp))
+            stats->mini_blocks++;
+        stats->free_bytes += stats->mini_blocks * DSIZE;
+        for (i = 0; i < QUICK_CLASSES; i++)
+            stats->free_bytes += quick_len[i] * (QUICK_MIN + (i << ALIGN_LOG2));
+        stats->quick_blocks = quick_count;
+    }
+    stats->used_bytes = stats->heap_bytes - stats->free_bytes;
+
+    memcpy(stats->mallocs, ops_global.mallocs, sizeof(stats->mallocs));
+    memcpy(stats->frees, ops_global.frees, sizeof(stats->frees));
+#ifdef MM_THREADS
+    pthread_mutex_lock(&tcache_list_lock);
+    for (tcache *tc = tcache_list; tc; tc = tc->next) {
+        if (__atomic_load_n(&tc->gen, __ATOMIC_RELAXED) != heap_gen)
+            continue;
+        for (i = 0; i < MM_STATS_CLASSES; i++) {
+            stats->mallocs[i] += __atomic_load_n(&tc->ops.mallocs[i], __ATOMIC_RELAXED);
+            stats->frees[i] += __atomic_load_n(&tc->ops.frees[i], __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&tcache_list_lock);
+#endif
+    stats->splits = stat_splits;
+    memcpy(stats->coalesces, stat_coalesces, sizeof(stats->coalesces));
+    stats->extends = stat_extends;
+    stats->realloc_copied = stat_realloc_copied;
+    stats->realloc_saved = stat_realloc_saved;
+    heap_release();
+}
+
 /*
  * Returns whether the pointer is in the heap.
  * May be useful for debugging.
@@ -526,15 +2965,27 @@ static bool aligned(const void* p)
 
 void printFree(void){
     size_t * p;
-    for ( int i = 0; i < BSZ_LEN; ++i  ){
-    for ( p = free_head[i]; p; p = (size_t*)p[1] ){
+    for ( int i = 0; i < BIN_LEN; ++i  ){
+    for ( p = free_head[i]; p; p = list_next ( p ) ){
         size_t hsize  = GET_SIZE(HDRP(p));
         size_t halloc = GET_ALLOC(HDRP(p));  
-        printf("free %4d: bp %p  prev %p  next %p  size %ld  %s\n",32<<i,p,(size_t*)(p[0]),(size_t*)(p[1]),hsize,halloc?"A":"F");
+        printf("free %2d.%-2d: bp %p  prev %p  next %p  size %ld  %s\n",i/SL_COUNT,i%SL_COUNT,p,list_prev(p),list_next(p),hsize,halloc?"A":"F");
     }
     }
+    for ( p = mini_head; p; p = mini_next ( p ) )
+        printf("mini    : bp %p  prev %p  next %p  size %ld  %s\n",p,mini_prev(p),mini_next(p),GET_SIZE(HDRP(p)),GET_ALLOC(HDRP(p))?"A":"F");
+    printTree ( large_root, 0 );
 
 }
+static void printTree ( tnode *z, int depth ){
+    if ( !z )
+        return;
+    printTree ( z->left, depth + 1 );
+    for ( tnode *p = z; p; p = p->next )
+        printf("tree %4d: bp %p  size %ld%s\n",depth,p,GET_SIZE(HDRP(p)),p==z?"":"  (same size)");
+    printTree ( z->right, depth + 1 );
+}
+
 void printHeap(void){
     void * bp;
     for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
@@ -547,32 +2998,82 @@ void printHeap(void){
 
 static void printblock(void *bp) 
 {
-    size_t hsize, halloc, fsize, falloc;
+    size_t hsize, halloc, hprev;
 
     mm_checkheap(0);
     hsize = GET_SIZE(HDRP(bp));
     halloc = GET_ALLOC(HDRP(bp));  
-    fsize = GET_SIZE(FTRP(bp));
-    falloc = GET_ALLOC(FTRP(bp));  
+    hprev = GET_PREV_ALLOC(HDRP(bp));
 
     if (hsize == 0) {
         printf("%p: EOL\n", bp);
         return;
     }
 
-    printf("%p: header: [%ld:%c] footer: [%ld:%c]\n", bp, 
-           hsize, (halloc ? 'a' : 'f'), 
-           fsize, (falloc ? 'a' : 'f')); 
+    if (halloc)
+        printf("%p: header: [%ld:%c%c]\n", bp, 
+               hsize, (hprev ? 'a' : 'f'), 'a');
+    else
+        printf("%p: header: [%ld:%c%c] footer: [%ld]\n", bp, 
+               hsize, (hprev ? 'a' : 'f'), 'f', GET_SIZE(FTRP(bp))); 
 }
 
 static void checkblock(void *bp) 
 {
     if ((size_t)bp % 8)
         printf("Error: %p is not doubleword aligned\n", bp);
-    if (GET(HDRP(bp)) != GET(FTRP(bp)))
+    if (!GET_ALLOC(HDRP(bp)) && !is_mini(GET_SIZE(HDRP(bp)))
+        && GET_SIZE(HDRP(bp)) != GET_SIZE(FTRP(bp)))
         printf("Error: header does not match footer\n");
 }
 
+/*
+ * Checks the size tree below z against the bounds (lo, hi) and returns
+ * the number of free bytes in it
+ */
+static size_t checktree ( tnode *z, tnode *parent, size_t lo, size_t hi ){
+    size_t size, bytes = 0;
+    tnode *p, *prev = NULL;
+
+    if ( !z )
+        return 0;
+    size = GET_SIZE(HDRP(z));
+    if ( z->parent != parent || z->prev || size <= lo || size >= hi
+         || !is_large ( size ) ){
+        printf("Bad size tree node %p!\n", z);
+        abort();
+    }
+    for ( p = z; p; prev = p, p = p->next ){
+        if ( !in_heap(p) || GET_ALLOC(HDRP(p)) || p->prev != prev
+             || GET_SIZE(HDRP(p)) != size ){
+            printf("Bad size tree list at %p!\n", p);
+            abort();
+        }
+        bytes += size;
+    }
+    return bytes + checktree ( z->left, z, lo, size )
+                 + checktree ( z->right, z, size, hi );
+}
+
+/* Checks a run and returns whether it has a free slot */
+static bool checkrun ( run *r ){
+    size_t free_slots = 0;
+
+    if ( (size_t)r % RUN_SIZE || GET_SIZE(HDRP(r)) != RUN_SIZE
+         || r->size % ALIGNMENT || r->size > RUN_MAX
+         || r->nslots != ( RUN_SIZE - WSIZE - RUN_HDR ) / r->size ){
+        printf("Bad run %p!\n", r);
+        abort();
+    }
+    for ( int i = 0; i < 4; ++i )
+        free_slots += __builtin_popcountll ( r->free_map[i] );
+    if ( free_slots != r->nfree || r->nfree >= r->nslots ){
+        printf("Bad free slot count in run %p!\n", r);
+        abort();
+    }
+    return r->nfree > 0;
+}
+
 static void prn(void){
     printHeap();
     printFree();
@@ -596,11 +3097,27 @@ bool mm_checkheap(int lineno)
         printf("Bad prologue header\n");
     checkblock(heap_listp);
 
-    size_t total_size = 0, free_size_total = 0;
+    size_t total_size = 0, free_size_total = 0, prev_alloc = 1, prev_size = 0;
+    size_t partial_runs = 0, runs[RUN_CLASSES] = { 0 };
     for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
         if (lineno) 
             printblock(bp);
         checkblock(bp);
+        if (GET_PREV_ALLOC(HDRP(bp)) != prev_alloc
+            || !(GET(HDRP(bp)) & PREV_MINI) != !is_mini(prev_size)) {
+            printf("Bad prev flags at %p!\n", bp);
+            abort();
+        }
+        if (!prev_alloc && !GET_ALLOC(HDRP(bp))) {
+            printf("Uncoalesced free blocks at %p!\n", bp);
+            abort();
+        }
+        if (GET_ALLOC(HDRP(bp)) && is_run(bp)) {
+            partial_runs += checkrun((run*)bp);
+            runs[run_class(((run*)bp)->size)]++;
+        }
+        prev_alloc = GET_ALLOC(HDRP(bp));
+        prev_size = GET_SIZE(HDRP(bp));
         total_size += GET_SIZE(HDRP(bp));
         if ( !GET_ALLOC(HDRP(bp)) )
             free_size_total += GET_SIZE(HDRP(bp));
@@ -609,38 +3126,124 @@ bool mm_checkheap(int lineno)
 
     if (lineno)
         printblock(bp);
-    if ((GET_SIZE(HDRP(bp)) != 0) || !(GET_ALLOC(HDRP(bp))))
+    if ((GET_SIZE(HDRP(bp)) != 0) || !(GET_ALLOC(HDRP(bp)))
+        || GET_PREV_ALLOC(HDRP(bp)) != prev_alloc
+        || !(GET(HDRP(bp)) & PREV_MINI) != !is_mini(prev_size))
         printf("Bad epilogue header\n");
 
-    //size_t free_size = 0;
+    size_t free_size = 0;
     {
         size_t *bp, *p;
-        for ( int i = 0; i < BSZ_LEN; ++i ){
-            for (bp = free_head[i]; bp ; bp = (size_t*)bp[1] ){
+        for ( int i = 0; i < BIN_LEN; ++i ){
+            bool bit = ( fl_bitmap >> ( i / SL_COUNT ) & 1 )
+                    && ( sl_bitmap[i / SL_COUNT] >> ( i % SL_COUNT ) & 1 );
+            if ( bit != ( free_head[i] != NULL ) ){
+                printf("Bad bitmap for bin %d.%d!\n", i / SL_COUNT, i % SL_COUNT);
+                abort();
+            }
+            size_t indexed = 0, spilled = 0;
+            for (p = NULL, bp = free_head[i]; bp ; p = bp, bp = list_next(bp) ){
+                if ( !in_heap(bp) || list_prev(bp) != p ){
+                    prn();
+                    printf("Bad Free List!\n");
+                    abort();
+                }
                 if (GET_ALLOC(HDRP(bp))) {
                     printf("Bad Free Block!\n");
                     abort();
                 }
-                //free_size = GET_SIZE(HDRP(bp));
-        
-                for ( p = (size_t*)heap_listp; GET_SIZE(HDRP(p)) > 0; p = NEXT_BLKP(p)) {
-                    if ( bp == p )
-                        break;
+                if ( is_large ( GET_SIZE(HDRP(bp)) )
+                     || get_free_index ( GET_SIZE(HDRP(bp)) ) != (size_t)i ){
+                    printf("Free block %p in wrong bin!\n", bp);
+                    abort();
                 }
-                if ( bp != p ){
-                    prn();
-                    printf("Bad Free List!\n");
+                if ( free_order == MM_ORDER_ADDRESS && p && p > bp ){
+                    printf("Free list %d out of address order at %p!\n", i, bp);
+                    abort();
+                }
+                if ( fidx_of ( i ) ){
+                    int s = fidx_find ( fidx_of ( i ), bp );
+                    if ( s < 0 )
+                        spilled++;
+                    else if ( fidx_of ( i )->size[s] != GET_SIZE(HDRP(bp)) ){
+                        printf("Stale fit index slot for %p!\n", bp);
+                        abort();
+                    }
+                    else
+                        indexed++;
+                }
+                free_size += GET_SIZE(HDRP(bp));
+            }
+            if ( fidx_of ( i ) ){
+                for ( int s = 0; s < FIDX_SLOTS; s++ )
+                    indexed -= fidx_of ( i )->size[s] != 0;
+                if ( indexed || spilled != fidx_spill[i - FIDX_FIRST] ){
+                    printf("Bad fit index for bin %d.%d!\n", i / SL_COUNT, i % SL_COUNT);
                     abort();
                 }
+            }
+        }
+        free_size += checktree ( large_root, NULL, 0, SIZE_MAX );
+        for ( bp = mini_head, p = NULL; bp; p = bp, bp = mini_next ( bp ) ){
+            if ( !in_heap(bp) || GET_ALLOC(HDRP(bp))
+                 || GET_SIZE(HDRP(bp)) != DSIZE || mini_prev ( bp ) != p ){
+                printf("Bad mini block %p!\n", bp);
+                abort();
+            }
+            free_size += DSIZE;
+        }
+    }
 
+    for ( size_t i = 0; i < RUN_CLASSES; ++i ){
+        run *r, *p = NULL;
+        if ( runs[i] != run_count[i] ){
+            printf("Run count %lu for class %lu, %lu in the heap!\n",
+                   run_count[i], i, runs[i]);
+            abort();
+        }
+        for ( r = run_head[i]; r; p = r, r = r->next ){
+            if ( !is_run ( r ) || r->prev != p || !r->nfree
+                 || run_class ( r->size ) != i ){
+                printf("Bad run list at %p!\n", r);
+                abort();
+            }
+            partial_runs--;
+        }
+    }
+    for ( size_t i = 0, n; i < QUICK_CLASSES; ++i ){
+        size_t *bp;
+        for ( n = 0, bp = quick_head[i]; bp; bp = (size_t*)bp[0], n++ ){
+            if ( !in_heap ( bp ) || !GET_ALLOC(HDRP(bp))
+                 || GET_SIZE(HDRP(bp)) != QUICK_MIN + i * ALIGNMENT ){
+                printf("Bad quick list block %p!\n", bp);
+                abort();
             }
         }
+        if ( n != quick_len[i] || ( n && !quick_hot[i] ) ){
+            printf("Bad quick list length %lu!\n", i);
+            abort();
+        }
+    }
+
+    for ( size_t i = 0; i < GROW_SLOTS; ++i ){
+        grow_note *g = &grow_log[i];
+        if ( g->bp && ( grow_slot ( g->bp ) != g || !in_heap ( g->bp )
+                        || !GET_ALLOC(HDRP(g->bp))
+                        || g->size > payload_size ( g->bp ) ) ){
+            printf("Bad grow note %p %lu!\n", g->bp, g->size);
+            abort();
+        }
+    }
+
+    if ( partial_runs ){
+        printf("Run with free slots missing from its list!\n");
+        abort();
     }
 
-   //if( free_size != free_size_total ){
-   //    printf("free_size = %ld free_size_total=%ld total=%ld total_size=%ld\n",free_size,free_size_total,total, total_size);
-   //     abort();
-   //}
+    if( free_size != free_size_total ){
+        printf("free_size = %ld free_size_total=%ld total=%ld total_size=%ld\n",free_size,free_size_total,total, total_size);
+        abort();
+    }
     }
 #endif
     return true;
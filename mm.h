@@ -8,6 +8,14 @@ extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc (size_t nmemb, size_t size);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+extern int mm_posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void mm_free_sized(void *ptr, size_t size);
+extern size_t mm_malloc_usable_size(void *ptr);
+extern size_t mm_good_size(size_t size);
+extern size_t mm_malloc_batch(size_t size, size_t n, void **out);
+extern void mm_free_batch(void **ptrs, size_t n);
 
 #else
 
@@ -16,10 +24,105 @@ extern void *malloc (size_t size);
 extern void free (void *ptr);
 extern void *realloc(void *ptr, size_t size);
 extern void *calloc (size_t nmemb, size_t size);
+extern void *memalign(size_t alignment, size_t size);
+extern void *aligned_alloc(size_t alignment, size_t size);
+extern int posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void free_sized(void *ptr, size_t size);
+extern size_t malloc_usable_size(void *ptr);
+extern size_t malloc_good_size(size_t size);
+extern size_t malloc_batch(size_t size, size_t n, void **out);
+extern void free_batch(void **ptrs, size_t n);
 
 #endif
 
+/* With MM_THREADS the allocator is thread-safe once mm_init has returned */
 extern bool mm_init(void);
 
+/* Free top blocks larger than bytes are given back with mem_sbrk */
+extern void mm_set_trim_threshold(size_t bytes);
+
+/* Requests of at least bytes are mapped on their own, outside the heap */
+extern void mm_set_huge_threshold(size_t bytes);
+
+/*
+ * Blocks of at least bytes are taken from the back of the free block
+ * they fit in, smaller ones from the front.  SIZE_MAX takes all from
+ * the front.  mm_split_threshold reports the current threshold.
+ */
+extern void mm_set_split_threshold(size_t bytes);
+extern size_t mm_split_threshold(void);
+
+/*
+ * Order of the blocks in each free list: most recently freed first, or
+ * by address so every fit takes the lowest block that serves it.
+ * Takes effect at the next mm_init.
+ */
+enum mm_free_order { MM_ORDER_LIFO, MM_ORDER_ADDRESS };
+extern void mm_set_free_order(enum mm_free_order order);
+
+/*
+ * How a free block is picked from the free lists: good fit looks at a
+ * few blocks of the request's size class, first fit takes the first
+ * block that fits, next fit goes on from where the last search of that
+ * class stopped and best fit takes the smallest block of the class.
+ * Takes effect at the next mm_init.  Until mm_set_policy is called, the
+ * MM_POLICY environment variable ("good", "first", "next" or "best")
+ * is read at mm_init, and mm_clear_policy goes back to reading it.
+ */
+enum mm_policy { MM_POLICY_GOOD, MM_POLICY_FIRST, MM_POLICY_NEXT, MM_POLICY_BEST };
+#define MM_POLICIES 4
+extern void mm_set_policy(enum mm_policy policy);
+extern void mm_clear_policy(void);
+extern const char *mm_policy_name(enum mm_policy policy);
+
+/* Mallocs served from a quick list, out of those that could have been */
+extern void mm_quick_stats(size_t *hits, size_t *lookups);
+
+/*
+ * Heaps whose objects are freed all together, by rolling back to a mark
+ * or by destroying the heap.  mm_heap_free gives one object of size
+ * bytes back to its heap for reuse; objects larger than 4 KiB are only
+ * reclaimed in bulk.  Each heap is for one thread at a time.
+ */
+typedef struct mm_heap mm_heap;
+extern mm_heap *mm_heap_create(void);
+extern void *mm_heap_malloc(mm_heap *heap, size_t size);
+extern void mm_heap_free(mm_heap *heap, void *ptr, size_t size);
+extern void *mm_heap_mark(mm_heap *heap);
+extern void mm_heap_release(mm_heap *heap, void *mark);
+extern void mm_heap_destroy(mm_heap *heap);
+
+/*
+ * Allocator statistics.  Free block counts and byte totals are taken
+ * when mm_stats is called; the rest count operations since mm_init.
+ * Object class c holds objects whose block or run slot is at most
+ * 16 << c bytes, except the last class, which holds huge objects mapped
+ * outside the heap.
+ */
+#define MM_STATS_BINS    96
+#define MM_STATS_CLASSES 16
+
+struct mm_stats {
+    size_t heap_bytes;                   /* size of the heap */
+    size_t mapped_bytes;                 /* mapped outside it */
+    size_t free_bytes;                   /* in free and quick list blocks */
+    size_t used_bytes;                   /* the rest of the heap */
+    size_t bin_blocks[MM_STATS_BINS];    /* free blocks in each free list */
+    size_t tree_blocks;                  /* free blocks in the size tree */
+    size_t mini_blocks;                  /* free 16-byte blocks */
+    size_t quick_blocks;                 /* blocks on quick lists */
+    size_t mallocs[MM_STATS_CLASSES];    /* objects handed out, by class */
+    size_t frees[MM_STATS_CLASSES];      /* objects taken back, by class */
+    size_t splits;                       /* blocks split in two */
+    size_t coalesces[4];                 /* blocks freed with neither, the next,
+                                            the previous or both neighbours free */
+    size_t extends;                      /* calls to extend the heap */
+    size_t realloc_copied;               /* bytes copied by reallocs that moved */
+    size_t realloc_saved;                /* bytes reallocs did not copy, having
+                                            grown into predicted headroom */
+};
+
+extern void mm_stats(struct mm_stats *stats);
+
 /* This is for debugging.  Returns false if error encountered */
 extern bool mm_checkheap(int lineno);
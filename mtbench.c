@@ -0,0 +1,135 @@
+/*
+ * mtbench.c - producer/consumer benchmark for the thread-safe allocator
+ *
+ * Each pair of threads shares a ring of pointers: the producer mallocs
+ * objects and passes them on, the consumer frees them, so nearly every
+ * free is a remote one.  The run is repeated for 1..N pairs and the
+ * aggregate rate is printed for each.
+ *
+ * Build with "make clean && make THREADS=1 mtbench".
+ * Usage: mtbench [-p maxpairs] [-n objects per pair]
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#ifndef MM_THREADS
+#error "mtbench needs the thread-safe allocator: make THREADS=1 mtbench"
+#endif
+
+#define RING 1024   /* pointers in flight per pair, a power of two */
+
+typedef struct {
+    void *slot[RING];
+    size_t head __attribute__((aligned(64)));  /* written by the producer */
+    size_t tail __attribute__((aligned(64)));  /* written by the consumer */
+    size_t nobjs;
+    unsigned seed;
+} ring_t;
+
+static void *producer(void *arg)
+{
+    ring_t *r = arg;
+    unsigned seed = r->seed;
+
+    for (size_t i = 0; i < r->nobjs; i++) {
+        /* Mostly small objects, with one in eight up to 4 KiB */
+        size_t size = 1 + rand_r(&seed) % (rand_r(&seed) % 8 ? 256 : 4096);
+        char *p = mm_malloc(size);
+
+        if (p == NULL) {
+            fprintf(stderr, "mtbench: out of memory\n");
+            exit(1);
+        }
+        p[0] = (char)i;
+        while (i - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == RING)
+            sched_yield();
+        r->slot[i & (RING - 1)] = p;
+        __atomic_store_n(&r->head, i + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg)
+{
+    ring_t *r = arg;
+
+    for (size_t i = 0; i < r->nobjs; i++) {
+        while (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == i)
+            sched_yield();
+        mm_free(r->slot[i & (RING - 1)]);
+        __atomic_store_n(&r->tail, i + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/* Returns the seconds taken to push nobjs through each of npairs rings */
+static double run(size_t npairs, size_t nobjs)
+{
+    ring_t *rings = calloc(npairs, sizeof(ring_t));
+    pthread_t *tids = calloc(2 * npairs, sizeof(pthread_t));
+    struct timespec t0, t1;
+
+    if (rings == NULL || tids == NULL) {
+        fprintf(stderr, "mtbench: calloc failed\n");
+        exit(1);
+    }
+    mem_reset_brk();
+    mm_init();
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (size_t i = 0; i < npairs; i++) {
+        rings[i].nobjs = nobjs;
+        rings[i].seed = (unsigned)i + 1;
+        pthread_create(&tids[2 * i], NULL, producer, &rings[i]);
+        pthread_create(&tids[2 * i + 1], NULL, consumer, &rings[i]);
+    }
+    for (size_t i = 0; i < 2 * npairs; i++)
+        pthread_join(tids[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    free(rings);
+    free(tids);
+    return (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    size_t maxpairs = 4, nobjs = 1000000;
+    double base = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "p:n:")) != EOF) {
+        switch (c) {
+            case 'p':
+                maxpairs = strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                nobjs = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-p maxpairs] [-n objects]\n", argv[0]);
+                exit(1);
+        }
+    }
+
+    mem_init();
+    printf("%6s %8s %10s %8s %10s\n", "pairs", "threads", "secs", "Mops", "speedup");
+    for (size_t npairs = 1; npairs <= maxpairs; npairs++) {
+        double secs = run(npairs, nobjs);
+        /* one malloc and one free per object */
+        double mops = 2.0 * npairs * nobjs / secs / 1e6;
+
+        if (npairs == 1)
+            base = mops;
+        printf("%6zu %8zu %10.3f %8.1f %10.2f\n",
+               npairs, 2 * npairs, secs, mops, mops / base);
+    }
+    return 0;
+}